@@ -9,6 +9,7 @@
 
 #include "piccolo/kernel.h"
 #include "piccolo/table-registry.h"
+#include "piccolo/aggregator.h"
 
 #ifndef SWIG
 DECLARE_int32(shards);
@@ -29,4 +30,13 @@ DECLARE_int32(iterations);
 // executed with the bindings provided, once for each table entry.
 #define PMap(bindings, code)
 
+// As PMap, but run in rounds on the workers until the values passed to
+// add_delta() in a round sum to less than 'converged', or for 'max_rounds'
+// rounds.
+#define PLoop(bindings, max_rounds, converged, code)
+
+// As PMap, but only over the entries of the first table changed since the
+// last PMapChanged over it; see TableDescriptor::track_changes.
+#define PMapChanged(bindings, code)
+
 #endif /* CLIENT_H_ */
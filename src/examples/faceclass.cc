@@ -35,7 +35,8 @@ DEFINE_double(momentum, 0.3, "Momentum of BPNN");
 static TypedGlobalTable<int, double>* nn_weights  = NULL;
 static TypedGlobalTable<int, double>* nn_biases   = NULL;
 static TypedGlobalTable<int, IMAGE>*  train_ims   = NULL;
-static TypedGlobalTable<int, double>* performance = NULL;
+static Aggregator<double>* ims_correct = NULL;
+static Aggregator<double>* total_err   = NULL;
 
 //-----------------------------------------------
 // Marshalling for IMAGE* type
@@ -308,28 +309,14 @@ class FCKernel : public DSMKernel {
 				imnet.load_target(&thisimg, net);					//load target output layer
 				delta = net->target[1] - net->output_units[1];
 				err   = 0.5*delta*delta;							//.5delta^2
-				performance->update(1,err);							//accumulate more error
+				total_err->update(err);								//accumulate more error
 
 				classed = (net->output_units[1] > 0.5);
 				classed = (net->target[1] > 0.5)?classed:!classed;
-				performance->update(0,classed?1:0);					//accumulate correct classifications
+				ims_correct->update(classed?1:0);					//accumulate correct classifications
 			}
 		}
 
-		void DisplayPerformance() {
-
-			double ims_correct = performance->get(0);
-			double total_err   = performance->get(1);
-			printf("Performance: %d of %d (%.0f%%) images correctly classified, average err %f\n",
-					(int)ims_correct,
-					FLAGS_total_ims,
-					round(100*(ims_correct/((double)FLAGS_total_ims))),
-					(total_err/((double)FLAGS_total_ims))
-				  );
-			performance->update(0,-ims_correct);
-			performance->update(1,-total_err);
-		}
-
 	private:
 		int TableToBPNN(BPNN* thisnet) {
 			int i,j;
@@ -376,7 +363,6 @@ REGISTER_METHOD(FCKernel, InitKernel);
 REGISTER_METHOD(FCKernel, Initialize);
 REGISTER_METHOD(FCKernel, TrainIteration);
 REGISTER_METHOD(FCKernel, PerformanceCheck);
-REGISTER_METHOD(FCKernel, DisplayPerformance);
 
 int Faceclass(ConfigData& conf) {
 	int i;
@@ -384,7 +370,8 @@ int Faceclass(ConfigData& conf) {
 	nn_weights  = CreateTable(0,conf.num_workers(),new Sharding::Mod,new Accumulators<double>::Sum);
 	nn_biases   = CreateTable(1,conf.num_workers(), new Sharding::Mod,new Accumulators<double>::Sum);
 	train_ims   = CreateTable(2,ceil(FLAGS_total_ims/FLAGS_sharding),new Sharding::Mod, new Accumulators<IMAGE>::Replace);
-	performance = CreateTable(3,1,new Sharding::Mod, new Accumulators<double>::Sum);
+	ims_correct = CreateAggregator(0, new Accumulators<double>::Sum, 0.0);
+	total_err   = CreateAggregator(1, new Accumulators<double>::Sum, 0.0);
 
 	StartWorker(conf);
 	Master m(conf);
@@ -406,7 +393,12 @@ int Faceclass(ConfigData& conf) {
 		printf("--- Running epoch %03d of %03d ---\n",i,FLAGS_epochs);
 		m.run_all("FCKernel","TrainIteration",train_ims);
 		m.run_all("FCKernel","PerformanceCheck",train_ims);
-		m.run_one("FCKernel","DisplayPerformance",performance);
+		printf("Performance: %d of %d (%.0f%%) images correctly classified, average err %f\n",
+				(int)ims_correct->get(),
+				FLAGS_total_ims,
+				round(100*(ims_correct->get()/((double)FLAGS_total_ims))),
+				(total_err->get()/((double)FLAGS_total_ims))
+			  );
 	}
 
 	return 0;
@@ -8,9 +8,8 @@ struct Point {
   int source;
 };
 
-struct Cluster {
-  float x, y;
-};
+// Cluster positions, as (x, y).
+typedef FixedVector<float, 2> Cluster;
 
 static TypedGlobalTable<int32_t, Point> *points;
 static TypedGlobalTable<int32_t, Cluster> *clusters;
@@ -21,16 +20,10 @@ Cluster random_cluster() {
   return c;
 }
 
-struct ClusterAccum : public Accumulator<Cluster> {
-  void Accumulate(Cluster* c1, const Cluster& c2) {
-    Cluster o = { c1->x + c2.x, c1->y + c2.y };
-    *c1 = o;
-  }
-};
-
 static int KMeans(ConfigData& conf) {
   const int num_shards = conf.num_workers() * 4;
-  clusters = CreateTable(0, num_shards, new Sharding::Mod, new ClusterAccum);
+  // Every point reads every cluster; keep a replica of the clusters on each worker.
+  clusters = CreateReplicatedTable(0, num_shards, new Sharding::Mod, new Accumulators<Cluster>::Sum);
   points = CreateTable(1, num_shards, new Sharding::Mod, new Accumulators<Point>::Replace);
   actual = CreateTable(2, num_shards, new Sharding::Mod, new Accumulators<Cluster>::Replace);
   
@@ -56,7 +49,7 @@ static int KMeans(ConfigData& conf) {
       const int num_shards = points->num_shards();
       for (int64_t i = current_shard(); i < FLAGS_num_points; i += num_shards) {
         Cluster c = actual->get(i % FLAGS_num_clusters);
-        Point p = { c.x + 0.1 * (rand_double() - 0.5), c.y + 0.1 * (rand_double() - 0.5), -1, 0 };
+        Point p = { c[0] + 0.1 * (rand_double() - 0.5), c[1] + 0.1 * (rand_double() - 0.5), -1, 0 };
         points->update(i, p);
       }
     });
@@ -67,7 +60,7 @@ static int KMeans(ConfigData& conf) {
           p.min_dist = 2;
           for (int i = 0; i < FLAGS_num_clusters; ++i) {
             const Cluster& c = clusters->get(i);
-            double d_squared = pow(p.x - c.x, 2) + pow(p.y - c.y, 2);
+            double d_squared = pow(p.x - c[0], 2) + pow(p.y - c[1], 2);
             if (d_squared < p.min_dist) {
               p.min_dist = d_squared;
               p.source = i;
@@ -78,11 +71,11 @@ static int KMeans(ConfigData& conf) {
       // Reset cluster positions.  If a cluster has no points, assign it the
       // position of a random point instead.
       PMap({ c : clusters }, {
-        if (c.x == 0 && c.y == 0) {
+        if (c[0] == 0 && c[1] == 0) {
           Point p = points->get(random() % FLAGS_num_points);
-          c.x = p.x; c.y = p.y;
+          c[0] = p.x; c[1] = p.y;
         } else {
-          c.x = 0; c.y = 0;
+          c[0] = 0; c[1] = 0;
         }
       });
       
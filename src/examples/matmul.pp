@@ -22,6 +22,11 @@ struct Block {
   ~Block() { delete [] d; }
 };
 
+// Exchange buffers rather than contents, e.g. in TypedGlobalTable::take_update.
+inline void swap(Block& a, Block& b) {
+  std::swap(a.d, b.d);
+}
+
 namespace dsm {
 template <>
 struct Marshal<Block> {
@@ -43,9 +48,7 @@ static TypedGlobalTable<int, Block>* matrix_c = NULL;
 
 struct BlockSum : public Accumulator<Block> {
   void Accumulate(Block *a, const Block& b) {
-    for (int i = 0; i < FLAGS_block_size * FLAGS_block_size; ++i) {
-      a->d[i] += b.d[i];
-    }
+    sum_arrays(a->d, b.d, FLAGS_block_size * FLAGS_block_size);
   }
 };
 
@@ -85,7 +88,7 @@ struct MatrixMultiplicationKernel : public DSMKernel {
   }
 
   void Multiply() {
-    Block a, b, c;
+    Block b, c;
 
     // If work stealing occurs, this could be a kernel instance that
     // didn't run Initialize, so fetch parameters again.
@@ -96,12 +99,14 @@ struct MatrixMultiplicationKernel : public DSMKernel {
       for (int i = 0; i < bRows; i++) {
         for (int j = 0; j < bCols; j++) {
           if (!is_local(i, k)) { continue; }
-          a = matrix_a->get(block_id(i, k));
           b = matrix_b->get(block_id(k, j));
-          cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-                      FLAGS_block_size, FLAGS_block_size, FLAGS_block_size, 1,
-                      a.d, FLAGS_block_size, b.d, FLAGS_block_size, 1, c.d, FLAGS_block_size);
-          matrix_c->update(block_id(i, j), c);
+          {
+            TypedGlobalTable<int, Block>::LocalRef a(matrix_a, block_id(i, k));
+            cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                        FLAGS_block_size, FLAGS_block_size, FLAGS_block_size, 1,
+                        a->d, FLAGS_block_size, b.d, FLAGS_block_size, 0, c.d, FLAGS_block_size);
+          }
+          matrix_c->take_update(block_id(i, j), &c);
         }
       }
     }
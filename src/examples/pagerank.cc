@@ -255,6 +255,8 @@ private:
   int num_shards_;
 };
 
+static DoubleBufferedTable<PageId, float>* pr_tables = NULL;
+
 class PRKernel : public DSMKernel {
 public:
   int iter;
@@ -263,8 +265,8 @@ public:
   TypedGlobalTable<PageId, float>* next_pr_hash;
 
   void InitKernel() {
-    curr_pr_hash = this->get_table<PageId, float>(0);
-    next_pr_hash = this->get_table<PageId, float>(1);
+    curr_pr_hash = pr_tables->current();
+    next_pr_hash = pr_tables->next();
   }
 
   void BuildGraph() {
@@ -314,10 +316,7 @@ public:
       struct PageId p = P(n.site(), n.id());
       next_pr_hash->update(p, random_restart_seed());
 
-      float v = 0;
-      if (curr_pr_hash->contains(p)) {
-        v = curr_pr_hash->get_local(P(n.site(), n.id()));
-      }
+      float v = curr_pr_hash->get_or(p, 0);
 
       float contribution = kPropagationFactor * v / n.target_site_size();
       for (int i = 0; i < n.target_site_size(); ++i) {
@@ -330,19 +329,12 @@ public:
     gethostname(host, 1024);
     VLOG(1) << "Finished shard " << current_shard() << " on " << host << " in " << t.elapsed();
   }
-
-  void ResetTable() {
-    // Move the values computed from the last iteration into the current table.
-    swap(curr_pr_hash, next_pr_hash);
-    next_pr_hash->clear(current_shard());
-  }
 };
 REGISTER_KERNEL(PRKernel);
 REGISTER_METHOD(PRKernel, BuildGraph);
 REGISTER_METHOD(PRKernel, Initialize);
 REGISTER_METHOD(PRKernel, WriteStatus);
 REGISTER_METHOD(PRKernel, PageRankIter);
-REGISTER_METHOD(PRKernel, ResetTable);
 
 int Pagerank(ConfigData& conf) {
   NUM_WORKERS = conf.num_workers();
@@ -358,9 +350,7 @@ int Pagerank(ConfigData& conf) {
   pr_desc->sharder = new SiteSharding;
   pr_desc->accum = new Accumulators<float>::Sum;
 
-  CreateTable<PageId, float>(pr_desc);
-  pr_desc->table_id = 1;
-  CreateTable<PageId, float>(pr_desc);
+  pr_tables = CreateDoubleBufferedTable<PageId, float>(pr_desc, 1);
 
   StartWorker(conf);
 
@@ -388,22 +378,20 @@ int Pagerank(ConfigData& conf) {
   }
 
   for (; i < FLAGS_iterations; ++i) {
-    int curr_pr = (i % 2 == 0) ? 0 : 1;
-    int next_pr = (i % 2 == 0) ? 1 : 0;
-
     {
-      RunDescriptor r("PRKernel", "PageRankIter", TableRegistry::Get()->table(curr_pr));
+      RunDescriptor r("PRKernel", "PageRankIter", pr_tables->current());
       r.checkpoint_type = CP_MASTER_CONTROLLED;
-      // We only need to save the next_pr table, which alternates each iteration.
-      r.checkpoint_tables = MakeVector(next_pr);
+      // We only need to save the next table, which holds this iteration's values.
+      r.checkpoint_tables = MakeVector(pr_tables->next()->id());
       r.shards = range(FLAGS_shards);
       m.run_all(r);
     }
 
-    m.run_all("PRKernel", "ResetTable",  TableRegistry::Get()->table(curr_pr));
+    // Move the values computed in this iteration into the current table.
+    m.swap_buffers(pr_tables);
 
     {
-      RunDescriptor status("PRKernel", "WriteStatus",  TableRegistry::Get()->table(curr_pr));
+      RunDescriptor status("PRKernel", "WriteStatus",  pr_tables->current());
       status.params.put<int>("iteration", i);
       m.run_one(status);
     }
@@ -9,6 +9,9 @@ static int NUM_WORKERS = 0;
 static TypedGlobalTable<int, double>* distance_map;
 static RecordTable<PathNode>* nodes;
 
+// The distance each local node last propagated to its targets.
+static unordered_map<int, double> propagated;
+
 static void BuildGraph(int shards, int nodes, int density) {
   vector<RecordFile*> out(shards);
   File::Mkdirs("testdata/");
@@ -59,13 +62,19 @@ int ShortestPath(ConfigData& conf) {
     distance_map->update(0, 0);
   });
 
-  for (int i = 0; i < 20; ++i) {
-    PMap({n : nodes}, {
+  // Propagate distances from nodes whose distance changed since they last
+  // did so, until none change.
+  PLoop({n : nodes}, 100, 1, {
+      double d = distance_map->get(n->id());
+      unordered_map<int, double>::iterator p = propagated.find(n->id());
+      if (p == propagated.end() || d < p->second) {
+        propagated[n->id()] = d;
+        add_delta(1);
         for (int j = 0; j < n->target_size(); ++j) {
-          distance_map->update(n->target(j), distance_map->get(n->id()) + 1);
+          distance_map->update(n->target(j), d + 1);
         }
-    });
-  }
+      }
+  });
 
   PRunOne(distance_map, {
     for (int i = 0; i < FLAGS_num_nodes; ++i) {
@@ -9,9 +9,22 @@ static TypedGlobalTable<int, int>* max_hash = NULL;
 static TypedGlobalTable<int, int>* sum_hash = NULL;
 static TypedGlobalTable<int, int>* replace_hash = NULL;
 static TypedGlobalTable<int, string>* string_hash = NULL;
+static TypedGlobalTable<int, int>* sorted_table = NULL;
+static TypedGlobalTable<int, int>* clock_hash = NULL;
+static TypedGlobalTable<int, int>* changed_hash = NULL;
+static TypedGlobalTable<int, double>* held_hash = NULL;
+static TypedGlobalTable<int, int>* priority_hash = NULL;
+static DoubleBufferedTable<int, int>* buffered = NULL;
+static TypedGlobalTable<int, int>* replica_hash = NULL;
+static TypedGlobalTable<int, int>* split_hash = NULL;
+static Aggregator<int>* put_count = NULL;
 
 //static TypedGlobalTable<int, Pair>* pair_hash = NULL;
 
+struct AddOne {
+  void operator()(int* v, bool inserted) { *v += 1; }
+};
+
 class TableKernel : public DSMKernel {
 public:
   void TestPut() {
@@ -22,6 +35,8 @@ public:
       sum_hash->update(i, 1);
       replace_hash->update(i, i);
       string_hash->update(i, StringPrintf("%d", i));
+      sorted_table->update(FLAGS_table_size - 1 - i, 1);
+      put_count->update(1);
 //      p.set_key(StringPrintf("%d", i));
 //      p.set_value(StringPrintf("%d", i));
 //      pair_hash->update(i, p);
@@ -42,6 +57,11 @@ public:
     }
   }
 
+  // The total written by TestPut is broadcast to the next kernel.
+  void TestAggregator() {
+    CHECK_EQ(put_count->get(), FLAGS_table_size * min_hash->num_shards());
+  }
+
   void TestGetLocal() {
     TypedTableIterator<int, int> *it = min_hash->get_typed_iterator(current_shard());
     int num_shards = min_hash->num_shards();
@@ -79,14 +99,260 @@ public:
       }
     }
   }
+
+  void TestRange() {
+    int n = sorted_table->num_shards();
+    int num_shards = min_hash->num_shards();
+    for (int k = 0; k < n; k++) {
+      int lo = FLAGS_table_size * k / n + 10;
+      int hi = FLAGS_table_size * (k + 1) / n - 10;
+      TypedTableIterator<int, int> *it = sorted_table->get_range_iterator(k, lo, hi);
+      int expected = lo;
+      while (!it->done()) {
+        CHECK_EQ(it->key(), expected);
+        CHECK_EQ(it->value(), num_shards);
+        ++expected;
+        it->Next();
+      }
+      CHECK_EQ(expected, hi);
+      delete it;
+    }
+  }
+
+  // Every shard writes every tenth key, so each shard's changed keys are its
+  // keys divisible by ten.
+  void TestChangedPut() {
+    for (int i = 0; i < FLAGS_table_size; i += 10) {
+      changed_hash->update(i, 1);
+    }
+  }
+
+  void TestChangedIterator() {
+    int num_shards = changed_hash->num_shards();
+    int expected = 0;
+    for (int i = 0; i < FLAGS_table_size; i += 10) {
+      if (changed_hash->get_shard(i) == current_shard()) {
+        ++expected;
+      }
+    }
+
+    TypedTableIterator<int, int> *it = changed_hash->get_changed_iterator(current_shard());
+    int seen = 0;
+    for (; !it->done(); it->Next()) {
+      CHECK_EQ(it->key() % 10, 0) << " k= " << it->key();
+      CHECK_EQ(it->value(), num_shards) << " k= " << it->key();
+      ++seen;
+    }
+    delete it;
+    CHECK_EQ(seen, expected);
+
+    // The changes were taken by the first iterator.
+    it = changed_hash->get_changed_iterator(current_shard());
+    CHECK(it->done());
+    delete it;
+  }
+
+  // Each update is below the table's delta threshold, so updates to remote
+  // shards are held back until the master asks for them.
+  void TestHeldPut() {
+    for (int i = 0; i < FLAGS_table_size; ++i) {
+      held_hash->update(i, 1.0);
+    }
+  }
+
+  void TestHeldGetLocal() {
+    TypedTableIterator<int, double> *it = held_hash->get_typed_iterator(current_shard());
+    int num_shards = held_hash->num_shards();
+    for (; !it->done(); it->Next()) {
+      CHECK_EQ(it->value(), num_shards) << " k= " << it->key();
+    }
+    delete it;
+  }
+
+  void TestPriorityPut() {
+    for (int i = 0; i < FLAGS_table_size; ++i) {
+      priority_hash->update(i, (i * 7919) % FLAGS_table_size);
+    }
+  }
+
+  // Keys come out smallest value first, in batches, until none are left.
+  void TestPriorityIterator() {
+    int expected = 0;
+    for (int i = 0; i < FLAGS_table_size; ++i) {
+      if (priority_hash->get_shard(i) == current_shard()) {
+        ++expected;
+      }
+    }
+
+    int seen = 0;
+    int last = -1;
+    while (true) {
+      TypedTableIterator<int, int> *it = priority_hash->get_priority_iterator(current_shard(), 100);
+      if (it->done()) {
+        delete it;
+        break;
+      }
+      for (; !it->done(); it->Next()) {
+        CHECK_GE(it->value(), last) << " k= " << it->key();
+        last = it->value();
+        ++seen;
+      }
+      delete it;
+    }
+    CHECK_EQ(seen, expected);
+  }
+
+  void TestBufferedPut() {
+    for (int i = 0; i < FLAGS_table_size; ++i) {
+      buffered->next()->update(i, 1);
+    }
+  }
+
+  // After a swap, the current table holds what was written to the next.
+  void TestBufferedSwapped() {
+    int num_shards = buffered->current()->num_shards();
+    int expected = 0;
+    for (int i = 0; i < FLAGS_table_size; ++i) {
+      if (buffered->current()->get_shard(i) == current_shard()) {
+        ++expected;
+      }
+    }
+
+    int seen = 0;
+    TypedTableIterator<int, int> *it = buffered->current()->get_typed_iterator(current_shard());
+    for (; !it->done(); it->Next()) {
+      CHECK_EQ(it->value(), num_shards) << " k= " << it->key();
+      ++seen;
+    }
+    delete it;
+    CHECK_EQ(seen, expected);
+
+    it = buffered->next()->get_typed_iterator(current_shard());
+    CHECK(it->done());
+    delete it;
+  }
+
+  // Each shard writes its own keys; every shard then reads all of them,
+  // remote ones from its replica.
+  void TestReplicaPut() {
+    for (int i = 0; i < FLAGS_table_size; ++i) {
+      if (replica_hash->get_shard(i) == current_shard()) {
+        replica_hash->update(i, i);
+      }
+    }
+  }
+
+  void TestReplicaGet() {
+    for (int i = 0; i < FLAGS_table_size; ++i) {
+      CHECK(replica_hash->contains(i)) << " i= " << i;
+      CHECK_EQ(replica_hash->get(i), i) << " i= " << i;
+    }
+  }
+
+  // Shard 0 gets every key, so it becomes large enough for the master to
+  // split once the kernel finishes.
+  void TestSplitPut() {
+    if (current_shard() != 0) {
+      return;
+    }
+    for (int i = 0; i < FLAGS_table_size; ++i) {
+      split_hash->update(i * split_hash->num_shards(), i);
+    }
+  }
+
+  // Whether or not shard 0 was split, every key must be found, in the shard
+  // it now maps to.
+  void TestSplitGet() {
+    TypedTableIterator<int, int> *it = split_hash->get_typed_iterator(current_shard());
+    for (; !it->done(); it->Next()) {
+      CHECK_EQ(split_hash->get_shard(it->key()), current_shard()) << " k= " << it->key();
+    }
+    delete it;
+
+    if (current_shard() == 0) {
+      int shards = split_hash->info().max_shards / 2;
+      for (int i = 0; i < FLAGS_table_size; ++i) {
+        CHECK_EQ(split_hash->get(i * shards), i) << " i= " << i;
+      }
+    }
+  }
+
+  // A key of our shard which TestPut did not write.
+  void TestUpsert() {
+    int k = FLAGS_table_size * sum_hash->num_shards() + current_shard();
+    CHECK(!sum_hash->contains(k));
+    CHECK_EQ(sum_hash->get_or(k, -1), -1);
+
+    sum_hash->upsert(k, AddOne());
+    sum_hash->upsert(k, AddOne());
+    {
+      TypedGlobalTable<int, int>::LocalRef v(sum_hash, k);
+      CHECK_EQ(*v, 2);
+    }
+    CHECK_EQ(sum_hash->get_or(k, -1), 2);
+  }
+
+  void TestTakeUpdate() {
+    int k = FLAGS_table_size * string_hash->num_shards() + current_shard();
+    string v("taken");
+    string_hash->take_update(k, &v);
+
+    TypedGlobalTable<int, string>::LocalRef r(string_hash, k);
+    CHECK_EQ(*r, "taken");
+  }
+
+  // Each round adds one to the entry for every shard; a shard must see the
+  // updates of all rounds older than the staleness bound.
+  void TestStaleness() {
+    int iteration = get_arg<int>("iteration");
+    int staleness = get_arg<int>("staleness");
+    int num_shards = clock_hash->num_shards();
+
+    int seen = clock_hash->contains(current_shard()) ? clock_hash->get(current_shard()) : 0;
+    CHECK_GE(seen, (iteration - staleness) * num_shards) << " iteration= " << iteration;
+
+    for (int i = 0; i < num_shards; ++i) {
+      clock_hash->update(i, 1);
+    }
+  }
 };
 
 REGISTER_KERNEL(TableKernel);
 REGISTER_METHOD(TableKernel, TestPut);
 REGISTER_METHOD(TableKernel, TestGet);
+REGISTER_METHOD(TableKernel, TestAggregator);
 REGISTER_METHOD(TableKernel, TestGetLocal);
 REGISTER_METHOD(TableKernel, TestClear);
 REGISTER_METHOD(TableKernel, TestIterator);
+REGISTER_METHOD(TableKernel, TestRange);
+REGISTER_METHOD(TableKernel, TestStaleness);
+REGISTER_METHOD(TableKernel, TestChangedPut);
+REGISTER_METHOD(TableKernel, TestChangedIterator);
+REGISTER_METHOD(TableKernel, TestHeldPut);
+REGISTER_METHOD(TableKernel, TestHeldGetLocal);
+REGISTER_METHOD(TableKernel, TestPriorityPut);
+REGISTER_METHOD(TableKernel, TestPriorityIterator);
+REGISTER_METHOD(TableKernel, TestBufferedPut);
+REGISTER_METHOD(TableKernel, TestBufferedSwapped);
+REGISTER_METHOD(TableKernel, TestReplicaPut);
+REGISTER_METHOD(TableKernel, TestReplicaGet);
+REGISTER_METHOD(TableKernel, TestSplitPut);
+REGISTER_METHOD(TableKernel, TestSplitGet);
+REGISTER_METHOD(TableKernel, TestUpsert);
+REGISTER_METHOD(TableKernel, TestTakeUpdate);
+
+// A sparse table keyed by int and sharded by key; callers set the options
+// under test before creating the table.
+template <class V>
+static TableDescriptor* SparseDescriptor(int id, Accumulator<V>* accum) {
+  TableDescriptor *d = new TableDescriptor(id, FLAGS_shards);
+  d->key_marshal = new Marshal<int>;
+  d->value_marshal = new Marshal<V>;
+  d->sharder = new Sharding::Mod;
+  d->partition_factory = new typename SparseTable<int, V>::Factory;
+  d->accum = accum;
+  return d;
+}
 
 static int TestTables(ConfigData &conf) {
   min_hash = CreateTable(0, FLAGS_shards, new Sharding::Mod, new Accumulators<int>::Min);
@@ -95,9 +361,64 @@ static int TestTables(ConfigData &conf) {
   replace_hash = CreateTable(3, FLAGS_shards, new Sharding::Mod, new Accumulators<int>::Replace);
   string_hash = CreateTable(4, FLAGS_shards, new Sharding::Mod, new Accumulators<string>::Replace);
 
+  vector<int> splits;
+  for (int i = 1; i < FLAGS_shards; ++i) {
+    splits.push_back(FLAGS_table_size * i / FLAGS_shards);
+  }
+
+  TableDescriptor *sorted = new TableDescriptor(5, FLAGS_shards);
+  sorted->key_marshal = new Marshal<int>;
+  sorted->value_marshal = new Marshal<int>;
+  sorted->sharder = new Sharding::Range<int>(splits);
+  sorted->partition_factory = new SortedTable<int, int>::Factory;
+  sorted->accum = new Accumulators<int>::Sum;
+  sorted_table = CreateTable<int, int>(sorted);
+
+  clock_hash = CreateTable(6, FLAGS_shards, new Sharding::Mod, new Accumulators<int>::Sum);
+  TableDescriptor *changed = SparseDescriptor<int>(7, new Accumulators<int>::Sum);
+  changed->track_changes = true;
+  changed_hash = CreateTable<int, int>(changed);
+
+  TableDescriptor *held = new TableDescriptor(8, FLAGS_shards);
+  held->key_marshal = new Marshal<int>;
+  held->value_marshal = new Marshal<double>;
+  held->sharder = new Sharding::Mod;
+  held->partition_factory = new SparseTable<int, double>::Factory;
+  held->accum = new Accumulators<double>::Sum;
+  held->delta_threshold = 1.5;
+  held_hash = CreateTable<int, double>(held);
+
+  TableDescriptor *priority = new TableDescriptor(9, FLAGS_shards);
+  priority->key_marshal = new Marshal<int>;
+  priority->value_marshal = new Marshal<int>;
+  priority->sharder = new Sharding::Mod;
+  priority->partition_factory = new SparseTable<int, int>::Factory;
+  priority->accum = new Accumulators<int>::Min;
+  priority->track_changes = true;
+  priority->priority = new Priorities<int, int>::Smallest;
+  priority_hash = CreateTable<int, int>(priority);
+
+  TableDescriptor *buffers = new TableDescriptor(10, FLAGS_shards);
+  buffers->key_marshal = new Marshal<int>;
+  buffers->value_marshal = new Marshal<int>;
+  buffers->sharder = new Sharding::Mod;
+  buffers->partition_factory = new SparseTable<int, int>::Factory;
+  buffers->accum = new Accumulators<int>::Sum;
+  buffered = CreateDoubleBufferedTable<int, int>(buffers, 11);
+
+  replica_hash = CreateReplicatedTable(12, FLAGS_shards, new Sharding::Mod, new Accumulators<int>::Replace);
+
+  TableDescriptor *split = SparseDescriptor<int>(13, new Accumulators<int>::Replace);
+  split->max_shards = 2 * FLAGS_shards;
+  split_hash = CreateTable<int, int>(split);
+
+  put_count = CreateAggregator(0, new Accumulators<int>::Sum, 0, true);
+
   if (!StartWorker(conf)) {
     Master m(conf);
     m.run_all("TableKernel", "TestPut",  min_hash);
+    CHECK_EQ(put_count->get(), FLAGS_table_size * FLAGS_shards);
+    m.run_all("TableKernel", "TestAggregator",  min_hash);
     //m.checkpoint();
 
     // wipe all the tables and then restore from the previous checkpoint.
@@ -110,6 +431,44 @@ static int TestTables(ConfigData &conf) {
     m.run_all("TableKernel", "TestGet",  min_hash);
 
 		m.run_one("TableKernel", "TestIterator",  min_hash);
+    m.run_one("TableKernel", "TestRange",  min_hash);
+
+    // Rebuild and check the tables as one graph of runs, with no barrier
+    // between runs.
+    RunGraph g;
+    int clear = g.add(RunDescriptor("TableKernel", "TestClear", min_hash));
+    int put = g.add(RunDescriptor("TableKernel", "TestPut", min_hash));
+    int check = g.add(RunDescriptor("TableKernel", "TestGetLocal", min_hash));
+    g.add_dependency(put, clear);
+    g.add_dependency(check, put);
+    m.run_graph(g);
+
+    RunDescriptor stale("TableKernel", "TestStaleness", clock_hash);
+    stale.params.put<int>("staleness", 2);
+    m.run_iterations(stale, 10, 2);
+
+    m.run_all("TableKernel", "TestChangedPut",  changed_hash);
+    m.run_all("TableKernel", "TestChangedIterator",  changed_hash);
+
+    m.run_all("TableKernel", "TestHeldPut",  held_hash);
+    m.flush_held_updates();
+    m.run_all("TableKernel", "TestHeldGetLocal",  held_hash);
+
+    m.run_all("TableKernel", "TestPriorityPut",  priority_hash);
+    m.run_all("TableKernel", "TestPriorityIterator",  priority_hash);
+
+    m.run_all("TableKernel", "TestBufferedPut",  buffered->current());
+    m.swap_buffers(buffered);
+    m.run_all("TableKernel", "TestBufferedSwapped",  buffered->current());
+
+    m.run_all("TableKernel", "TestReplicaPut",  replica_hash);
+    m.run_all("TableKernel", "TestReplicaGet",  replica_hash);
+
+    m.run_all("TableKernel", "TestSplitPut",  split_hash);
+    m.run_all("TableKernel", "TestSplitGet",  split_hash);
+
+    m.run_all("TableKernel", "TestUpsert",  sum_hash);
+    m.run_all("TableKernel", "TestTakeUpdate",  string_hash);
   }
   return 0;
 }
@@ -0,0 +1,173 @@
+#ifndef AGGREGATOR_H_
+#define AGGREGATOR_H_
+
+#include "piccolo/common.h"
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace dsm {
+
+// A global value which kernels contribute to, combined with an accumulator.
+//
+// Each worker combines the contributions of its own kernels.  At the
+// barrier ending a kernel, the partial values are combined on the way up
+// the master's barrier tree; the total of the kernel's contributions is
+// then available on the master, and, for broadcast aggregators, on every
+// worker during the next kernel.
+class AggregatorBase : private boost::noncopyable {
+public:
+  AggregatorBase(int id, bool broadcast) : id_(id), broadcast_(broadcast) {}
+  virtual ~AggregatorBase() {}
+
+  int id() const { return id_; }
+  bool broadcast() const { return broadcast_; }
+
+  // Marshal this process's partial value and start a new one.  Returns
+  // false if nothing was contributed.
+  virtual bool take_partial(string* out) = 0;
+
+  // Combine a partial value from another process with ours.
+  virtual void merge_partial(const StringPiece& s) = 0;
+
+  // Master only: make the combined partial values the new total, and start
+  // a new one.  The total is marshalled into 'out'.
+  virtual void finish(string* out) = 0;
+
+  // Workers only: set the total computed by the master.
+  virtual void set_total(const StringPiece& s) = 0;
+
+  // Workers only: while a speculative kernel runs, its contributions are
+  // held aside until EndSpeculation keeps or discards them, as its table
+  // updates are.
+  virtual void BeginSpeculation() = 0;
+  virtual void EndSpeculation(bool commit) = 0;
+
+private:
+  int id_;
+  bool broadcast_;
+};
+
+template <class V>
+class Aggregator : public AggregatorBase {
+public:
+  Aggregator(int id, Accumulator<V>* accum, const V& initial, bool broadcast) :
+    AggregatorBase(id, broadcast), accum_(accum), initial_(initial),
+    total_(initial), has_partial_(false), speculating_(false), has_held_(false) {}
+
+  // Add to this worker's contribution.
+  void update(const V& v) {
+    boost::mutex::scoped_lock sl(lock_);
+    if (speculating_) {
+      add(&held_, &has_held_, v);
+    } else {
+      add(&partial_, &has_partial_, v);
+    }
+  }
+
+  // The initial value combined with every contribution made during the last
+  // kernel.
+  const V& get() const { return total_; }
+
+  bool take_partial(string* out) {
+    boost::mutex::scoped_lock sl(lock_);
+    if (!has_partial_) {
+      return false;
+    }
+    marshal_.marshal(partial_, out);
+    has_partial_ = false;
+    return true;
+  }
+
+  void merge_partial(const StringPiece& s) {
+    V v;
+    marshal_.unmarshal(s, &v);
+    boost::mutex::scoped_lock sl(lock_);
+    add(&partial_, &has_partial_, v);
+  }
+
+  void finish(string* out) {
+    boost::mutex::scoped_lock sl(lock_);
+    total_ = initial_;
+    if (has_partial_) {
+      accum_->Accumulate(&total_, partial_);
+      has_partial_ = false;
+    }
+    marshal_.marshal(total_, out);
+  }
+
+  void set_total(const StringPiece& s) {
+    boost::mutex::scoped_lock sl(lock_);
+    marshal_.unmarshal(s, &total_);
+  }
+
+  void BeginSpeculation() {
+    boost::mutex::scoped_lock sl(lock_);
+    speculating_ = true;
+    has_held_ = false;
+  }
+
+  void EndSpeculation(bool commit) {
+    boost::mutex::scoped_lock sl(lock_);
+    if (commit && has_held_) {
+      add(&partial_, &has_partial_, held_);
+    }
+    speculating_ = false;
+    has_held_ = false;
+  }
+
+private:
+  // Combine 'v' into '*into', which holds a value if '*has' is set.
+  void add(V* into, bool* has, const V& v) {
+    if (*has) {
+      accum_->Accumulate(into, v);
+    } else {
+      *into = v;
+      *has = true;
+    }
+  }
+
+  Accumulator<V>* accum_;
+  Marshal<V> marshal_;
+  V initial_;
+  V total_;
+  V partial_;
+  bool has_partial_;
+
+  // Contributions of the running speculative kernel.
+  V held_;
+  bool speculating_;
+  bool has_held_;
+  boost::mutex lock_;
+};
+
+class AggregatorRegistry : private boost::noncopyable {
+private:
+  AggregatorRegistry() {}
+public:
+  typedef map<int, AggregatorBase*> Map;
+
+  static AggregatorRegistry* Get() {
+    static AggregatorRegistry* r = new AggregatorRegistry;
+    return r;
+  }
+
+  Map& aggregators() { return m_; }
+
+private:
+  Map m_;
+};
+
+// Create an aggregator, on the master and every worker alike.  If
+// 'broadcast' is true, workers receive the total after each kernel.
+template <class V>
+static Aggregator<V>* CreateAggregator(int id, Accumulator<V>* accum,
+                                       const V& initial, bool broadcast=false) {
+  Aggregator<V>* a = new Aggregator<V>(id, accum, initial, broadcast);
+  CHECK(AggregatorRegistry::Get()->aggregators().insert(make_pair(id, a)).second)
+      << "Duplicate aggregator " << id;
+  return a;
+}
+
+}
+
+#endif /* AGGREGATOR_H_ */
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <sched.h>
 #include <execinfo.h>
 #include <fcntl.h>
 
@@ -124,6 +125,36 @@ void SpinLock::unlock() volatile {
   d = 0;
 }
 
+// Number of failed attempts before a waiting thread yields the processor.
+static const int kSpinsBeforeYield = 64;
+
+void RWSpinLock::lock_shared() volatile {
+  for (int spins = 1; ; ++spins) {
+    int v = d;
+    if (writers == 0 && v >= 0 && __sync_bool_compare_and_swap(&d, v, v + 1)) {
+      return;
+    }
+    if (spins % kSpinsBeforeYield == 0) { sched_yield(); }
+  }
+}
+
+void RWSpinLock::unlock_shared() volatile {
+  __sync_fetch_and_sub(&d, 1);
+}
+
+void RWSpinLock::lock() volatile {
+  __sync_fetch_and_add(&writers, 1);
+  for (int spins = 1; !__sync_bool_compare_and_swap(&d, 0, -1); ++spins) {
+    if (spins % kSpinsBeforeYield == 0) { sched_yield(); }
+  }
+  __sync_fetch_and_sub(&writers, 1);
+}
+
+void RWSpinLock::unlock() volatile {
+  __sync_synchronize();
+  d = 0;
+}
+
 static void FatalSignalHandler(int sig) {
   fprintf(stderr, "Fatal error; signal %d occurred.\n", sig);
   static SpinLock lock;
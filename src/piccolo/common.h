@@ -74,6 +74,22 @@ private:
   volatile int d;
 };
 
+// Reader/writer spin lock: any number of readers, or a single writer.
+// Waiting writers block new readers, so a stream of readers cannot starve
+// them.  Usable with boost::shared_lock and boost::unique_lock.
+class RWSpinLock {
+public:
+  RWSpinLock() : d(0), writers(0) {}
+  void lock_shared() volatile;
+  void unlock_shared() volatile;
+  void lock() volatile;
+  void unlock() volatile;
+private:
+  // -1 if held by a writer, otherwise the number of readers.
+  volatile int d;
+  volatile int writers;
+};
+
 static double rand_double() {
   return double(random()) / RAND_MAX;
 }
@@ -104,6 +120,11 @@ private:
 template <class V>
 struct Accumulator {
   virtual void Accumulate(V* a, const V& b) = 0;
+
+  // Combine the 'n' values starting at 'b' with those starting at 'a'.
+  virtual void Accumulate(V* a, const V* b, int n) {
+    for (int i = 0; i < n; ++i) { Accumulate(a + i, b[i]); }
+  }
 };
 
 template <class K>
@@ -111,6 +132,13 @@ struct Sharder {
   virtual int operator()(const K& k, int shards) = 0;
 };
 
+// Orders the changed entries of a table for priority iteration; entries
+// with the smallest priority come first.
+template <class K, class V>
+struct Prioritizer {
+  virtual double operator()(const K& k, const V& v) = 0;
+};
+
 template <class T, class Enable = void>
 struct Marshal {
   virtual void marshal(const T& t, string* out) {
@@ -137,6 +165,23 @@ struct Marshal<T, typename boost::enable_if<boost::is_base_of<google::protobuf::
   void unmarshal(const StringPiece& s, google::protobuf::Message* t) { t->ParseFromArray(s.data, s.len); }
 };
 
+// Approximate number of bytes needed to transmit a value; used to bound the
+// amount of data buffered for remote peers.
+template <class T, class Enable = void>
+struct ByteSize {
+  static int64_t get(const T& t) { return sizeof(T); }
+};
+
+template <class T>
+struct ByteSize<T, typename boost::enable_if<boost::is_base_of<string, T> >::type> {
+  static int64_t get(const string& t) { return t.size(); }
+};
+
+template <class T>
+struct ByteSize<T, typename boost::enable_if<boost::is_base_of<google::protobuf::Message, T> >::type> {
+  static int64_t get(const google::protobuf::Message& t) { return t.ByteSize(); }
+};
+
 template <class T>
 string marshal(Marshal<T>* m, const T& t) { string out; m->marshal(t, &out); return out; }
 
@@ -142,17 +142,39 @@ public:
 
   void remove(const K& k) { LOG(FATAL) << "Not implemented."; }
 
+  // Keys in a block which exists are present, with a default value if they
+  // were never written.
+  V* find(const K& k) {
+    if (!contains(k)) {
+      return NULL;
+    }
+    return &get_block(k)[block_pos(k)];
+  }
+
+  V* find_or_insert(const K& k, bool *inserted) {
+    *inserted = !(last_block_ && start_key(k) == last_block_start_) && !contains(k);
+    return &get_block(k)[block_pos(k)];
+  }
+
   bool contains_str(const StringPiece& s) {
     K k;
     ((Marshal<K>*)info_->key_marshal)->unmarshal(s, &k);
     return contains(k);
   }
 
+  // Remote reads may be served by several threads at once, so avoid
+  // creating blocks or touching the block cache here.
   string get_str(const StringPiece &s) {
     K k;
     ((Marshal<K>*)info_->key_marshal)->unmarshal(s, &k);
     string out;
-    ((Marshal<V>*)info_->value_marshal)->marshal(get(k), &out);
+
+    typename BucketMap::const_iterator i = m_.find(start_key(k));
+    if (i == m_.end() || i->second.entries.empty()) {
+      ((Marshal<V>*)info_->value_marshal)->marshal(V(), &out);
+    } else {
+      ((Marshal<V>*)info_->value_marshal)->marshal(i->second.entries[block_pos(k)], &out);
+    }
     return out;
   }
 
@@ -200,8 +222,12 @@ public:
     }
   }
 
+  // Blocks are combined with a single batched call to the accumulator.
+  // Values marshalled as plain data are copied out of the message in one
+  // piece; others are unmarshalled one at a time.
   void ApplyUpdates(TableCoder *in) {
     K k;
+    std::vector<V> tmp(info_->block_size);
 
     string kt, vt;
     while (in->ReadEntry(&kt, &vt)) {
@@ -210,13 +236,16 @@ public:
       V* block = get_block(k);
       const int value_size = vt.size() / info_->block_size;
 
-      V tmp;
-      for (int j = 0; j < info_->block_size; ++j) {
-        ((Marshal<V>*)info_->value_marshal)->unmarshal(
-            StringPiece(vt.data() + (value_size * j), value_size),
-            &tmp);
-        ((Accumulator<V>*)info_->accum)->Accumulate(&block[j], tmp);
+      if (std::tr1::is_pod<V>::value && value_size == sizeof(V)) {
+        memcpy(&tmp[0], vt.data(), vt.size());
+      } else {
+        for (int j = 0; j < info_->block_size; ++j) {
+          ((Marshal<V>*)info_->value_marshal)->unmarshal(
+              StringPiece(vt.data() + (value_size * j), value_size),
+              &tmp[j]);
+        }
       }
+      ((Accumulator<V>*)info_->accum)->Accumulate(block, &tmp[0], info_->block_size);
     }
   }
 
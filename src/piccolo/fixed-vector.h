@@ -0,0 +1,94 @@
+#ifndef FIXED_VECTOR_H_
+#define FIXED_VECTOR_H_
+
+#include "piccolo/common.h"
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace dsm {
+
+// Element-wise combination of arrays: a[i] = op(a[i], b[i]).  Used by the
+// accumulators of vector values and by batched accumulation; float and
+// double arrays use SSE when the compiler targets it.
+template <class T>
+inline void sum_arrays(T* a, const T* b, int n) {
+  for (int i = 0; i < n; ++i) { a[i] = a[i] + b[i]; }
+}
+
+template <class T>
+inline void min_arrays(T* a, const T* b, int n) {
+  for (int i = 0; i < n; ++i) { a[i] = std::min(a[i], b[i]); }
+}
+
+template <class T>
+inline void max_arrays(T* a, const T* b, int n) {
+  for (int i = 0; i < n; ++i) { a[i] = std::max(a[i], b[i]); }
+}
+
+#ifdef __SSE2__
+#define SSE_ARRAY_OP(name, T, width, load, store, op, scalar)\
+inline void name(T* a, const T* b, int n) {\
+  int i = 0;\
+  for (; i + width <= n; i += width) {\
+    store(a + i, op(load(a + i), load(b + i)));\
+  }\
+  for (; i < n; ++i) { a[i] = scalar(a[i], b[i]); }\
+}
+
+#define SSE_ADD(x, y) ((x) + (y))
+
+SSE_ARRAY_OP(sum_arrays, float, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_add_ps, SSE_ADD)
+SSE_ARRAY_OP(min_arrays, float, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_min_ps, std::min)
+SSE_ARRAY_OP(max_arrays, float, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_max_ps, std::max)
+SSE_ARRAY_OP(sum_arrays, double, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, SSE_ADD)
+SSE_ARRAY_OP(min_arrays, double, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_min_pd, std::min)
+SSE_ARRAY_OP(max_arrays, double, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_max_pd, std::max)
+
+#undef SSE_ADD
+#undef SSE_ARRAY_OP
+#endif
+
+// A vector of N values, usable as a table value; it is marshalled as plain
+// data.  Accumulators<FixedVector<T, N> > combine vectors element-wise.
+template <class T, int N>
+struct FixedVector {
+  T v[N];
+
+  T& operator[](int i) { return v[i]; }
+  const T& operator[](int i) const { return v[i]; }
+  static int size() { return N; }
+};
+
+// Vectors of varying length are stored as std::vector.  Their accumulators
+// also work element-wise, on vectors of the same length.
+template <class T>
+struct Marshal<std::vector<T> > {
+  GOOGLE_GLOG_COMPILE_ASSERT(std::tr1::is_pod<T>::value, Invalid_Value_Type);
+
+  void marshal(const std::vector<T>& t, string *out) {
+    if (t.empty()) {
+      out->clear();
+    } else {
+      out->assign(reinterpret_cast<const char*>(&t[0]), sizeof(T) * t.size());
+    }
+  }
+
+  void unmarshal(const StringPiece& s, std::vector<T> *t) {
+    t->resize(s.len / sizeof(T));
+    if (!t->empty()) {
+      memcpy(&(*t)[0], s.data, s.len);
+    }
+  }
+};
+
+template <class T>
+struct ByteSize<std::vector<T> > {
+  static int64_t get(const std::vector<T>& t) { return sizeof(T) * t.size(); }
+};
+
+}
+
+#endif /* FIXED_VECTOR_H_ */
@@ -4,6 +4,12 @@
 static const int kMaxNetworkPending = 1 << 26;
 static const int kMaxNetworkChunk = 1 << 20;
 
+// Seconds to wait before asking again for a key still migrating.
+static const double kGetRetryDelay = 0.001;
+
+// Size write buffers are reset to when shrink_after_flush is set.
+static const int kShrinkSize = 1 << 10;
+
 namespace dsm {
 
 void GlobalTable::UpdatePartitions(const ShardInfo& info) {
@@ -13,6 +19,16 @@ void GlobalTable::UpdatePartitions(const ShardInfo& info) {
 GlobalTable::~GlobalTable() {
   for (int i = 0; i < partitions_.size(); ++i) {
     delete partitions_[i];
+    delete shard_locks_[i];
+  }
+
+  for (int i = 0; i < cache_.size(); ++i) {
+    delete cache_[i];
+  }
+
+  for (int i = 0; i < partinfo_.size(); ++i) {
+    delete partinfo_[i].speculation_buffer;
+    delete partinfo_[i].snapshot;
   }
 }
 
@@ -37,6 +53,41 @@ void GlobalTable::Init(const dsm::TableDescriptor *info) {
   worker_id_ = -1;
   partitions_.resize(info->num_shards);
   partinfo_.resize(info->num_shards);
+  for (int i = 0; i < info->num_shards; ++i) {
+    shard_locks_.push_back(new RWSpinLock);
+  }
+
+  CHECK(info->priority == NULL || info->track_changes)
+      << "Table " << info->table_id << ": priorities need track_changes.";
+
+  base_shards_ = info->num_shards;
+  has_splits_ = false;
+  children_.resize(info->num_shards);
+  split_bit_.resize(info->num_shards, 0);
+
+  // Reserve room for split shards up front: other threads may be reading
+  // these vectors while a shard is split.
+  if (info->max_shards > 0) {
+    CHECK(!info->replicated) << "Replicated tables cannot be split.";
+    partitions_.reserve(info->max_shards);
+    partinfo_.reserve(info->max_shards);
+    shard_locks_.reserve(info->max_shards);
+    children_.reserve(info->max_shards);
+    split_bit_.reserve(info->max_shards);
+  }
+
+  pending_bytes_ = 0;
+  last_flush_ = Now();
+  threaded_apply_ = false;
+  threaded_reads_ = false;
+  apply_lock_cycles_ = 0;
+  read_lock_cycles_ = 0;
+  migration_bytes_ = 0;
+  migration_micros_ = 0;
+  updates_sent_ = 0;
+  updates_held_ = 0;
+  speculating_ = false;
+  cancelled_ = false;
 }
 
 int64_t GlobalTable::shard_size(int shard) {
@@ -47,6 +98,13 @@ int64_t GlobalTable::shard_size(int shard) {
   }
 }
 
+void GlobalTable::take_changed(int shard, vector<string>* keys) {
+  boost::unique_lock<RWSpinLock> sl(shard_lock(shard));
+  unordered_set<string>& changed = get_partition_info(shard)->changed;
+  keys->assign(changed.begin(), changed.end());
+  changed.clear();
+}
+
 void GlobalTable::clear(int shard) {
   if (is_local_shard(shard)) {
     partitions_[shard]->clear();
@@ -72,9 +130,32 @@ void GlobalTable::resize(int64_t new_size) {
   }
 }
 
+void GlobalTable::swap_local(GlobalTable *other) {
+  CHECK_EQ(num_shards(), other->num_shards());
+  CHECK(!has_splits_ && !other->has_splits_) << "Cannot swap split tables.";
+
+  // Lock in table order, so concurrent swaps cannot deadlock.
+  GlobalTable *a = id() < other->id() ? this : other;
+  GlobalTable *b = id() < other->id() ? other : this;
+  for (int i = 0; i < partitions_.size(); ++i) {
+    if (!is_local_shard(i)) {
+      continue;
+    }
+    CHECK(other->is_local_shard(i)) << "Swapping " << MP(id(), i) << " with a remote shard.";
+
+    boost::unique_lock<RWSpinLock> la(a->shard_lock(i));
+    boost::unique_lock<RWSpinLock> lb(b->shard_lock(i));
+    partitions_[i]->swap(other->partitions_[i]);
+    other->partitions_[i]->clear();
+  }
+}
+
 void GlobalTable::set_worker(Worker* w) {
   w_ = w;
   worker_id_ = w->id();
+  peer_pending_bytes_.resize(NetworkThread::Get()->size(), 0);
+  threaded_apply_ = w->threaded_apply();
+  threaded_reads_ = w->threaded_reads();
 }
 
 bool GlobalTable::get_remote(int shard, const StringPiece& k, string* v) {
@@ -90,9 +171,17 @@ bool GlobalTable::get_remote(int shard, const StringPiece& k, string* v) {
   DCHECK_GE(peer, 0);
   DCHECK_LT(peer, MPI::COMM_WORLD.Get_size() - 1);
 
-  VLOG(2) << "Sending get request to: " << MP(peer, shard);
-  NetworkThread::Get()->Send(peer + 1, MTYPE_GET_REQUEST, req);
-  NetworkThread::Get()->Read(peer + 1, MTYPE_GET_RESPONSE, &resp);
+  // Ask again while the owner is still receiving the key's shard.
+  while (true) {
+    VLOG(2) << "Sending get request to: " << MP(peer, shard);
+    NetworkThread::Get()->Send(peer + 1, MTYPE_GET_REQUEST, req);
+    NetworkThread::Get()->Read(peer + 1, MTYPE_GET_RESPONSE, &resp);
+    if (!resp.retry()) {
+      break;
+    }
+    HandlePutRequests();
+    Sleep(kGetRetryDelay);
+  }
 
   if (resp.missing_key()) {
     return false;
@@ -144,84 +233,419 @@ void GlobalTable::restore(const string& f) {
 }
 
 void GlobalTable::handle_get(const HashGet& get_req, TableData *get_resp) {
-  boost::recursive_mutex::scoped_lock sl(mutex());
-
   int shard = get_req.shard();
   if (!is_local_shard(shard)) {
     LOG_EVERY_N(WARNING, 1000) << "Not local for shard: " << shard;
   }
 
+  boost::shared_lock<RWSpinLock> sl(shard_lock(shard));
+  Timer held;
+
+  // While the shard arrives from its previous owner, a key not yet in the
+  // partition may still be on its way, and later updates to a key that has
+  // arrived are held in the migration buffer.
+  PartitionInfo *p = get_partition_info(shard);
   LocalTable *t = (LocalTable*)partitions_[shard];
   if (!t->contains_str(get_req.key())) {
-    get_resp->set_missing_key(true);
+    if (p->tainted) {
+      get_resp->set_retry(true);
+    } else {
+      get_resp->set_missing_key(true);
+    }
   } else {
     Arg *kv = get_resp->add_kv_data();
     kv->set_key(get_req.key());
     kv->set_value(t->get_str(get_req.key()));
+    if (p->tainted && p->migration_buffer->contains_str(get_req.key())) {
+      combine_str(kv->mutable_value(), p->migration_buffer->get_str(get_req.key()));
+    }
   }
+
+  __sync_fetch_and_add(&read_lock_cycles_, held.cycles_elapsed());
 }
 
 void GlobalTable::HandlePutRequests() {
   w_->HandlePutRequests();
 }
 
-void GlobalTable::SendUpdates() {
-  TableData put;
-  for (int i = 0; i < partitions_.size(); ++i) {
-    LocalTable *t = partitions_[i];
+void GlobalTable::Poll() {
+  if (threaded_apply_) {
+    w_->CheckFlushDelays();
+  } else {
+    w_->HandlePutRequests();
+  }
+}
 
-    if (!is_local_shard(i) && (get_partition_info(i)->dirty || !t->empty())) {
-      // Always send at least one chunk, to ensure that we clear taint on
-      // tables we own.
-      do {
-        put.Clear();
-        put.set_shard(i);
-        put.set_source(w_->id());
-        put.set_table(id());
-        put.set_epoch(w_->epoch());
+void GlobalTable::SendShardUpdates(int shard, bool send_held) {
+  LocalTable *t = partitions_[shard];
+  PartitionInfo *p = get_partition_info(shard);
 
-        RPCTableCoder c(&put);
-        t->Serialize(&c);
-        t->clear();
+  if (is_local_shard(shard) || (!p->dirty && t->empty())) {
+    return;
+  }
 
-        put.set_done(true);
+  // Forwarded updates may be merged into this buffer by the apply thread.
+  boost::unique_lock<RWSpinLock> sl(shard_lock(shard));
 
-        VLOG(2) << "Sending update for " << MP(t->id(), t->shard()) << " to " << owner(i) << " size " << put.kv_data_size();
+  // Data for a shard we have lost ownership of must go directly to the new
+  // owner; other updates may be combined at our host aggregator first.
+  int target = p->dirty ? owner(shard) : w_->update_target(owner(shard));
 
-        NetworkThread::Get()->Send(owner(i) + 1, MTYPE_PUT_REQUEST, put);
-      } while(!t->empty());
+  TableData data;
+  {
+    RPCTableCoder c(&data);
+    t->Serialize(&c);
+  }
+  t->clear();
+
+  // Hold back updates below the delta threshold: they go back into the
+  // buffer, to accumulate with later updates.  Data for a shard we no longer
+  // own is always sent in full.
+  int64_t held = 0;
+  if (info_->delta_threshold > 0 && !p->dirty && !send_held) {
+    int kept = 0;
+    for (int i = 0; i < data.kv_data_size(); ++i) {
+      const Arg& a = data.kv_data(i);
+      if (significant_update(a.value())) {
+        data.mutable_kv_data()->SwapElements(i, kept++);
+      } else {
+        t->update_str(a.key(), a.value());
+        held += a.key().size() + a.value().size();
+      }
+    }
+    __sync_fetch_and_add(&updates_held_, data.kv_data_size() - kept);
+    while (data.kv_data_size() > kept) {
+      data.mutable_kv_data()->RemoveLast();
+    }
+  }
+  __sync_fetch_and_add(&updates_sent_, data.kv_data_size());
 
-      VLOG(2) << "Done with update for " << MP(t->id(), t->shard());
-      t->clear();
+  // Send the data in chunks of about kMaxNetworkChunk bytes, so the receiver
+  // can start using a migrating shard before all of it has arrived.  Always
+  // send at least one chunk, to ensure that we clear taint on tables we own;
+  // only the last chunk is marked done.
+  TableData put;
+  put.set_shard(shard);
+  put.set_source(w_->id());
+  put.set_table(id());
+  put.set_epoch(w_->epoch());
+  put.set_migration(p->dirty);
+
+  int64_t bytes = 0;
+  for (int i = 0; i < data.kv_data_size(); ++i) {
+    Arg *a = put.add_kv_data();
+    a->Swap(data.mutable_kv_data(i));
+    bytes += a->key().size() + a->value().size();
+
+    if (bytes >= kMaxNetworkChunk && i + 1 < data.kv_data_size()) {
+      put.set_done(false);
+      NetworkThread::Get()->Send(target + 1, MTYPE_PUT_REQUEST, put);
+      put.clear_kv_data();
+      bytes = 0;
     }
   }
 
-  pending_writes_ = 0;
+  // If every update was held back, there is nothing to send.
+  if (p->dirty || data.kv_data_size() > 0) {
+    put.set_done(true);
+    VLOG(2) << "Sending update for " << MP(t->id(), t->shard()) << " to " << target << " size " << data.kv_data_size();
+    NetworkThread::Get()->Send(target + 1, MTYPE_PUT_REQUEST, put);
+  }
+
+  if (info_->shrink_after_flush && t->empty()) {
+    t->resize(kShrinkSize);
+  }
+
+  // Held updates stay in the buffer, and still count against its limits.
+  p->pending_bytes = held;
+  p->dirty = false;
 }
 
-int GlobalTable::pending_write_bytes() {
-  int64_t s = 0;
+void GlobalTable::SendPeerUpdates(int peer) {
   for (int i = 0; i < partitions_.size(); ++i) {
-    LocalTable *t = partitions_[i];
-    if (!is_local_shard(i)) {
-      s += t->size();
+    if (owner(i) == peer) {
+      SendShardUpdates(i);
     }
   }
+  RecountPendingBytes();
+
+  // If held updates alone exceed the limit, send them as well.
+  if (peer_pending_bytes_[peer] > info_->max_peer_pending_bytes) {
+    for (int i = 0; i < partitions_.size(); ++i) {
+      if (owner(i) == peer) {
+        SendShardUpdates(i, true);
+      }
+    }
+    RecountPendingBytes();
+  }
+}
+
+void GlobalTable::SendUpdates(bool send_held) {
+  for (int i = 0; i < partitions_.size(); ++i) {
+    SendShardUpdates(i, send_held);
+  }
+  RecountPendingBytes();
 
-  return s;
+  if (pending_bytes_ > info_->max_pending_bytes) {
+    for (int i = 0; i < partitions_.size(); ++i) {
+      SendShardUpdates(i, true);
+    }
+    RecountPendingBytes();
+  }
+  last_flush_ = Now();
+}
+
+void GlobalTable::RecountPendingBytes() {
+  pending_bytes_ = 0;
+  std::fill(peer_pending_bytes_.begin(), peer_pending_bytes_.end(), 0);
+  for (int i = 0; i < partinfo_.size(); ++i) {
+    PartitionInfo *p = get_partition_info(i);
+    if (is_local_shard(i)) {
+      p->pending_bytes = 0;
+    } else if (p->pending_bytes > 0) {
+      pending_bytes_ += p->pending_bytes;
+      peer_pending_bytes_[p->owner] += p->pending_bytes;
+    }
+  }
 }
 
 void GlobalTable::ApplyUpdates(const dsm::TableData& req) {
-  boost::recursive_mutex::scoped_lock sl(mutex());
+  int shard = req.shard();
+  boost::unique_lock<RWSpinLock> sl(shard_lock(shard));
+  Timer held;
 
-  if (!is_local_shard(req.shard())) {
+  if (!is_local_shard(shard)) {
     LOG_EVERY_N(INFO, 1000)
-        << "Forwarding push request from: " << MP(id(), req.shard())
-        << " to " << owner(req.shard());
+        << "Forwarding push request from: " << MP(id(), shard)
+        << " to " << owner(shard);
   }
 
+  // While a shard migrates, only data from the old owner goes to the
+  // partition, so a key found there is complete apart from buffered updates.
+  PartitionInfo *p = get_partition_info(shard);
+  LocalTable *t = partitions_[shard];
+  if (p->tainted && !req.migration()) {
+    t = p->migration_buffer;
+  }
+
+  RPCTableCoder c(&req);
+  t->ApplyUpdates(&c);
+  record_changes(shard, req);
+
+  if (p->tainted && req.migration()) {
+    p->migration_bytes += req.ByteSize();
+    if (req.done()) {
+      FinishMigration(shard);
+    }
+  }
+
+  __sync_fetch_and_add(&apply_lock_cycles_, held.cycles_elapsed());
+}
+
+void GlobalTable::StartMigration(int shard) {
+  boost::unique_lock<RWSpinLock> sl(shard_lock(shard));
+  PartitionInfo *p = get_partition_info(shard);
+  if (p->tainted) {
+    return;
+  }
+
+  p->migration_buffer = create_local(shard);
+  p->migration_start = Now();
+  p->migration_bytes = 0;
+  p->tainted = true;
+}
+
+// Called with the shard lock held, once the last chunk has arrived.
+void GlobalTable::FinishMigration(int shard) {
+  PartitionInfo *p = get_partition_info(shard);
+
+  TableData buffered;
+  RPCTableCoder out(&buffered);
+  p->migration_buffer->Serialize(&out);
+  RPCTableCoder in(&buffered);
+  partitions_[shard]->ApplyUpdates(&in);
+
+  delete p->migration_buffer;
+  p->migration_buffer = NULL;
+  p->tainted = false;
+
+  double elapsed = Now() - p->migration_start;
+  __sync_fetch_and_add(&migration_bytes_, p->migration_bytes);
+  __sync_fetch_and_add(&migration_micros_, (int64_t)(elapsed * 1e6));
+
+  VLOG(1) << "Received " << MP(id(), shard) << ": " << p->migration_bytes
+          << " bytes in " << elapsed << " seconds.";
+}
+
+void GlobalTable::WaitForMigration(int shard) {
+  while (tainted(shard)) {
+    HandlePutRequests();
+    sched_yield();
+  }
+}
+
+void GlobalTable::BeginSpeculation() {
+  speculating_ = true;
+  cancelled_ = false;
+}
+
+// Committed updates are applied as if they had just been made: to local
+// shards directly, and to the write buffers of remote shards.
+void GlobalTable::EndSpeculation(bool commit) {
+  speculating_ = false;
+  cancelled_ = false;
+
+  for (int i = 0; i < partinfo_.size(); ++i) {
+    PartitionInfo *p = get_partition_info(i);
+    if (p->speculation_buffer == NULL) {
+      continue;
+    }
+
+    if (commit) {
+      TableData held;
+      RPCTableCoder out(&held);
+      p->speculation_buffer->Serialize(&out);
+
+      {
+        boost::unique_lock<RWSpinLock> sl(shard_lock(i));
+        LocalTable *t = p->tainted ? p->migration_buffer : partitions_[i];
+        RPCTableCoder in(&held);
+        t->ApplyUpdates(&in);
+        record_changes(i, held);
+      }
+
+      if (!is_local_shard(i)) {
+        add_pending_bytes(i, held.ByteSize());
+      }
+    }
+
+    delete p->speculation_buffer;
+    p->speculation_buffer = NULL;
+  }
+}
+
+void GlobalTable::FetchSnapshot(int shard) {
+  CHECK(!is_local_shard(shard)) << "Snapshot of a local shard: " << MP(id(), shard);
+  if (replicated() || partinfo_[shard].snapshot != NULL) {
+    return;
+  }
+
+  LocalTable *copy = create_local(shard);
+  TableIterator *it = get_iterator(shard);
+  string k, v;
+  for (; !it->done(); it->Next()) {
+    it->key_str(&k);
+    it->value_str(&v);
+    copy->update_str(k, v);
+  }
+  delete it;
+
+  partinfo_[shard].snapshot = copy;
+}
+
+void GlobalTable::DropSnapshot(int shard) {
+  delete partinfo_[shard].snapshot;
+  partinfo_[shard].snapshot = NULL;
+}
+
+int GlobalTable::split_shard(int shard) {
+  CHECK_LT(num_shards(), info_->max_shards) << "Too many splits of table " << id();
+
+  int child = partitions_.size();
+  int bit = split_bit_[shard] + children_[shard].size();
+  CHECK_LT(bit, 32) << "Shard split too many times: " << MP(id(), shard);
+
+  partitions_.push_back(create_local(child));
+  partinfo_.push_back(PartitionInfo());
+  partinfo_[child].owner = partinfo_[shard].owner;
+  shard_locks_.push_back(new RWSpinLock);
+  children_.push_back(vector<int>());
+  split_bit_.push_back(bit + 1);
+
+  boost::unique_lock<RWSpinLock> sl(shard_lock(shard));
+  boost::unique_lock<RWSpinLock> child_sl(shard_lock(child));
+
+  children_[shard].push_back(child);
+  info_->num_shards++;
+  has_splits_ = true;
+
+  // Redistribute the shard's entries; those now mapping to the child move.
+  TableData moved;
+  RPCTableCoder out(&moved);
+  partitions_[shard]->Serialize(&out);
+  partitions_[shard]->clear();
+
+  RPCTableCoder in(&moved);
+  string k, v;
+  while (in.ReadEntry(&k, &v)) {
+    int s = get_shard_str(k);
+    partitions_[s]->update_str(k, v);
+    if (s != child) {
+      continue;
+    }
+    if (partinfo_[shard].changed.erase(k)) {
+      partinfo_[child].changed.insert(k);
+    }
+    // Queued keys move too; the child's iterators score them afresh.
+    if (partinfo_[shard].queued_priority.count(k)) {
+      double priority = partinfo_[shard].queued_priority[k];
+      partinfo_[shard].queued.erase(make_pair(priority, k));
+      partinfo_[shard].queued_priority.erase(k);
+      partinfo_[child].changed.insert(k);
+    }
+  }
+
+  VLOG(1) << "Split " << MP(id(), shard) << " into " << MP(shard, child) << "; "
+          << partitions_[shard]->size() << " and " << partitions_[child]->size() << " entries.";
+  return child;
+}
+
+void GlobalTable::SendReplicas() {
+  for (int i = 0; i < partitions_.size(); ++i) {
+    if (!is_local_shard(i)) {
+      continue;
+    }
+
+    TableData put;
+    put.set_shard(i);
+    put.set_source(w_->id());
+    put.set_table(id());
+    put.set_epoch(w_->epoch());
+    put.set_done(true);
+
+    {
+      boost::shared_lock<RWSpinLock> sl(shard_lock(i));
+      RPCTableCoder c(&put);
+      partitions_[i]->Serialize(&c);
+    }
+
+    // Rank 0 is the master; workers are ranks 1 and up.
+    for (int j = 1; j < NetworkThread::Get()->size(); ++j) {
+      if (j != worker_id_ + 1) {
+        NetworkThread::Get()->Send(j, MTYPE_REPLICA_DATA, put);
+      }
+    }
+  }
+}
+
+void GlobalTable::KeepReplica(int shard) {
+  TableData data;
+  data.set_shard(shard);
+  {
+    boost::shared_lock<RWSpinLock> sl(shard_lock(shard));
+    RPCTableCoder out(&data);
+    partitions_[shard]->Serialize(&out);
+  }
+  ApplyReplica(data);
+}
+
+void GlobalTable::ApplyReplica(const TableData& req) {
+  CHECK(replicated());
+  LocalTable *t = cache_[req.shard()];
+  t->clear();
+
   RPCTableCoder c(&req);
-  partitions_[req.shard()]->ApplyUpdates(&c);
+  t->ApplyUpdates(&c);
 }
 
 void GlobalTable::get_local(const StringPiece &k, string* v) {
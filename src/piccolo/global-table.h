@@ -7,6 +7,10 @@
 #include "piccolo/file.h"
 #include "piccolo/rpc.h"
 
+#include <boost/type_traits/is_arithmetic.hpp>
+#include <set>
+#include <math.h>
+
 namespace dsm {
 
 class Worker;
@@ -19,11 +23,40 @@ public:
   virtual ~GlobalTable();
 
   struct PartitionInfo {
-    PartitionInfo() : dirty(false), tainted(false), owner(-1) {}
+    PartitionInfo() : dirty(false), tainted(false), owner(-1), pending_bytes(0),
+                      migration_buffer(NULL), migration_start(0), migration_bytes(0),
+                      speculation_buffer(NULL), snapshot(NULL) {}
     bool dirty;
     bool tainted;
     int owner;
     ShardInfo sinfo;
+
+    // Bytes of updates buffered locally for this (remote) shard.
+    int64_t pending_bytes;
+
+    // While a shard we now own is arriving from its old owner (tainted), the
+    // partition holds only data from the old owner; other updates are held
+    // in migration_buffer and merged in once the last chunk arrives.
+    LocalTable *migration_buffer;
+    double migration_start;
+    int64_t migration_bytes;
+
+    // Updates to this shard made by a speculative kernel, held until the
+    // master commits or aborts the kernel.
+    LocalTable *speculation_buffer;
+
+    // A copy of this (remote) shard, taken for a backup kernel running on it.
+    LocalTable *snapshot;
+
+    // Marshalled keys of this (local) shard changed since the last changed
+    // iterator over it, if the table tracks changes.
+    unordered_set<string> changed;
+
+    // For tables with a priority: changed keys already scored, but not yet
+    // taken by a priority iterator, in priority order, and the priority of
+    // each.  Used by the kernel thread only.
+    std::set<pair<double, string> > queued;
+    unordered_map<string, double> queued_priority;
   };
 
   virtual PartitionInfo* get_partition_info(int shard) {
@@ -42,13 +75,53 @@ public:
   // Fill in a response from a remote worker for the given key.
   void handle_get(const HashGet& req, TableData* resp);
 
-  // Handle updates from the master or other workers.
-  void SendUpdates();
+  // Handle updates from the master or other workers.  If 'send_held' is
+  // true, updates held back by the table's delta threshold are sent too.
+  void SendUpdates(bool send_held=false);
   void ApplyUpdates(const TableData& req);
+
+  // Begin receiving 'shard' from its previous owner.  Keys are readable as
+  // soon as they arrive; WaitForMigration blocks until the whole shard has.
+  void StartMigration(int shard);
+  void WaitForMigration(int shard);
   void HandlePutRequests();
   void UpdatePartitions(const ShardInfo& sinfo);
 
-  int pending_write_bytes();
+  int64_t pending_write_bytes() { return pending_bytes_; }
+
+  // Split 'shard' in two, moving about half of its keys to a new shard owned
+  // by the same worker.  Returns the new shard.  Every worker and the master
+  // must apply the same splits in the same order.
+  int split_shard(int shard);
+
+  // For replicated tables: send the contents of each local shard to all
+  // peers, and replace the replica of a remote shard with its owner's data.
+  bool replicated() { return info_->replicated; }
+  void SendReplicas();
+  void ApplyReplica(const TableData& req);
+
+  // Replace the replica of local 'shard' with a copy of the shard, before
+  // giving it up, so reads of it are served until the next refresh.
+  void KeepReplica(int shard);
+
+  // Speculative kernels.  While speculating, updates made by the kernel are
+  // held aside, rather than applied or sent, until EndSpeculation commits
+  // them or throws them away.  Reads do not see the held updates.  Once
+  // cancelled, iterators returned to the kernel report that they are done,
+  // so that the kernel finishes early.
+  void BeginSpeculation();
+  void EndSpeculation(bool commit);
+  void CancelSpeculation() { cancelled_ = true; }
+  bool speculating() const { return speculating_; }
+
+  // Copy a remote shard from its owner, and serve reads of the shard from
+  // the copy until it is dropped.
+  void FetchSnapshot(int shard);
+  void DropSnapshot(int shard);
+
+  // Take the keys of 'shard' changed since the last call, and start
+  // recording anew.
+  void take_changed(int shard, vector<string>* keys);
 
   // Clear any local data for which this table has ownership.
   // Updates waiting to be sent to other workers are *not* cleared.
@@ -56,6 +129,11 @@ public:
   bool empty();
   void resize(int64_t new_size);
 
+  // Exchange the contents of our local shards with those of 'other', a
+  // table sharded the same way, then clear the shards of 'other'.  Shards
+  // keep their capacity.  Updates waiting to be sent are not moved.
+  void swap_local(GlobalTable *other);
+
   virtual void start_checkpoint(const string& f);
   virtual void write_delta(const TableData& d);
   virtual void finish_checkpoint();
@@ -66,12 +144,134 @@ public:
   virtual int get_shard_str(StringPiece k) = 0;
 protected:
   vector<PartitionInfo> partinfo_;
-  boost::recursive_mutex& mutex() { return m_; }
   vector<LocalTable*> partitions_;
+
+  // Replicas of remote shards, for replicated tables.
   vector<LocalTable*> cache_;
 
-  volatile int pending_writes_;
-  boost::recursive_mutex m_;
+  // Shard splits.  The sharder assigns keys to one of the table's original
+  // shards.  The i'th split of shard s moved the keys with bit
+  // (split_bit_[s] + i) of their split hash set to shard children_[s][i].
+  int base_shards_;
+  bool has_splits_;
+  vector<vector<int> > children_;
+  vector<int> split_bit_;
+
+  static uint32_t split_hash(const StringPiece& k) {
+    // Mix the bits, so they are independent of any sharding by hash value.
+    uint32_t h = k.hash();
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+  }
+
+  int split_child(int shard, uint32_t h) {
+    for (int i = 0; i < children_[shard].size(); ) {
+      if ((h >> (split_bit_[shard] + i)) & 1) {
+        shard = children_[shard][i];
+        i = 0;
+      } else {
+        ++i;
+      }
+    }
+    return shard;
+  }
+
+  virtual LocalTable* create_local(int shard) {
+    LOG(FATAL) << "Shards of table " << id() << " cannot be split.";
+    return NULL;
+  }
+
+  // Bytes buffered for remote shards, in total and for each peer.
+  int64_t pending_bytes_;
+  vector<int64_t> peer_pending_bytes_;
+  double last_flush_;
+
+  // Reader/writer locks for each shard.  Reads of a shard (remote gets and
+  // iterators) hold its lock shared; updates to the shard, or to the write
+  // buffer for a remote shard, hold it exclusively.  Accesses to different
+  // shards never contend.
+  vector<RWSpinLock*> shard_locks_;
+  RWSpinLock& shard_lock(int shard) { return *shard_locks_[shard]; }
+
+  // True if updates from peers are applied by the worker's apply thread,
+  // concurrently with the kernel; the kernel must then lock shards it reads.
+  bool threaded_apply_;
+
+  // True if requests from peers are served by the worker's server threads;
+  // the kernel must then lock shards it writes.
+  bool threaded_reads_;
+
+  // Cycles spent holding shard locks while applying peer updates and while
+  // serving peer reads.  Updated atomically, as several threads may hold
+  // locks on different shards at once.
+  volatile uint64_t apply_lock_cycles_;
+  volatile uint64_t read_lock_cycles_;
+
+  // Shards received from their previous owners: total bytes, and the time
+  // (in microseconds) from reassignment until the last chunk arrived.
+  volatile int64_t migration_bytes_;
+  volatile int64_t migration_micros_;
+
+  // Buffered updates sent, and held back by the delta threshold, at each
+  // flush of a remote shard's buffer.
+  volatile int64_t updates_sent_;
+  volatile int64_t updates_held_;
+
+  // True if a buffered update, in marshalled form, is large enough to send
+  // under the table's delta threshold.
+  virtual bool significant_update(const StringPiece& v) { return true; }
+
+  // Combine the marshalled value 'other' into '*v' with the table's
+  // accumulator.
+  virtual void combine_str(string *v, const StringPiece& other) {
+    LOG(FATAL) << "Table " << id() << " cannot combine values.";
+  }
+
+  void FinishMigration(int shard);
+
+  // Record the keys of an update to a local shard as changed.  Called with
+  // the shard lock held.
+  void record_changes(int shard, const TableData& req) {
+    if (info_->track_changes && is_local_shard(shard)) {
+      for (int i = 0; i < req.kv_data_size(); ++i) {
+        partinfo_[shard].changed.insert(req.kv_data(i).key());
+      }
+    }
+  }
+
+  // Set by the kernel thread only.
+  bool speculating_;
+  volatile bool cancelled_;
+
+  LocalTable* speculation_buffer(int shard) {
+    PartitionInfo *p = get_partition_info(shard);
+    if (p->speculation_buffer == NULL) {
+      p->speculation_buffer = create_local(shard);
+    }
+    return p->speculation_buffer;
+  }
+
+  // Shard locks taken by the kernel thread around accesses to a partition.
+  // These are no-ops unless another thread can touch the partition.
+  struct KernelReadLock {
+    KernelReadLock(GlobalTable *t, int shard) : l(t->shard_lock(shard), boost::defer_lock) {
+      if (t->threaded_apply_) { l.lock(); }
+    }
+
+    boost::shared_lock<RWSpinLock> l;
+  };
+
+  struct KernelWriteLock {
+    KernelWriteLock(GlobalTable *t, int shard) : l(t->shard_lock(shard), boost::defer_lock) {
+      if (t->threaded_apply_ || t->threaded_reads_) { l.lock(); }
+    }
+
+    boost::unique_lock<RWSpinLock> l;
+  };
 
   friend class Worker;
   Worker *w_;
@@ -79,6 +279,48 @@ protected:
 
   void set_worker(Worker *w);
 
+  // Account for 'bytes' of new data buffered for the remote 'shard', and
+  // flush buffered updates if any of the table's buffer limits are exceeded.
+  void add_pending_bytes(int shard, int64_t bytes) {
+    if (bytes > 0) {
+      int peer = owner(shard);
+      partinfo_[shard].pending_bytes += bytes;
+      peer_pending_bytes_[peer] += bytes;
+      pending_bytes_ += bytes;
+
+      if (peer_pending_bytes_[peer] > info_->max_peer_pending_bytes) {
+        SendPeerUpdates(peer);
+      }
+    }
+
+    if (pending_bytes_ > info_->max_pending_bytes) {
+      SendUpdates();
+    }
+  }
+
+  // Flush buffered updates if they have waited longer than the table's
+  // max_flush_delay.  Checked by the kernel thread whenever it polls for
+  // network activity, so that a slow writer does not hold back its peers.
+  void CheckFlushDelay() {
+    if (pending_bytes_ > 0 && Now() - last_flush_ > info_->max_flush_delay) {
+      SendUpdates();
+    }
+  }
+
+  // Called periodically by table operations in the kernel thread: apply
+  // updates from peers, unless the apply thread does, and flush buffered
+  // updates which have waited too long.
+  void Poll();
+
+  // Send buffered updates for a single shard, or for all shards owned by 'peer'.
+  // Updates held back by the delta threshold are sent too if 'send_held'
+  // is set, or if they alone exceed the buffer limits.
+  void SendShardUpdates(int shard, bool send_held=false);
+  void SendPeerUpdates(int peer);
+
+  // Recompute the buffered byte totals from those of each remote shard.
+  void RecountPendingBytes();
+
   // Fetch the given key, using only local information.
   void get_local(const StringPiece &k, string *v);
 
@@ -86,6 +328,48 @@ protected:
   bool get_remote(int shard, const StringPiece &k, string* v);
 };
 
+// Wraps the iterators given to a speculative kernel, ending them early if
+// the kernel is cancelled.
+template <class K, class V>
+class SpeculativeIterator : public TypedTableIterator<K, V> {
+public:
+  SpeculativeIterator(TypedTableIterator<K, V>* it, volatile bool* cancelled) :
+    it_(it), cancelled_(cancelled) {}
+  ~SpeculativeIterator() { delete it_; }
+
+  void key_str(string *out) { it_->key_str(out); }
+  void value_str(string *out) { it_->value_str(out); }
+  bool done() { return *cancelled_ || it_->done(); }
+  void Next() { it_->Next(); }
+  const K& key() { return it_->key(); }
+  V& value() { return it_->value(); }
+
+private:
+  TypedTableIterator<K, V>* it_;
+  volatile bool* cancelled_;
+};
+
+// The size of a numeric update, for comparison with a delta threshold.
+template <class V>
+static double magnitude(const V& v, boost::true_type) { return fabs((double)v); }
+
+template <class V>
+static double magnitude(const V& v, boost::false_type) { return 0; }
+
+// True if 'accum' sums numeric values.  Small updates can only be held
+// back, and sent later combined with others, for sums: a small update to
+// a Min table, say, may be just the one that matters.
+template <class V>
+static bool sums_values(void *accum, boost::true_type) {
+  return dynamic_cast<typename Accumulators<V>::Sum*>((Accumulator<V>*)accum) != NULL;
+}
+
+template <class V>
+static bool sums_values(void *accum, boost::false_type) { return false; }
+
+template <class K, class V>
+class ChangedIterator;
+
 template <class K, class V>
 class TypedGlobalTable :
   public GlobalTable,
@@ -95,107 +379,350 @@ public:
   typedef TypedTableIterator<K, V> Iterator;
   virtual void Init(const TableDescriptor *tinfo) {
     GlobalTable::Init(tinfo);
+    CHECK(info_->delta_threshold <= 0 || sums_values<V>(info_->accum, boost::is_arithmetic<V>()))
+        << "Table " << id() << ": delta thresholds need numeric values accumulated by Sum.";
     for (int i = 0; i < partitions_.size(); ++i) {
       partitions_[i] = create_local(i);
     }
-
-    pending_writes_ = 0;
+    CHECK(info_->max_shards == 0 || partitions_.empty() || partitions_[0]->splittable())
+        << "Table " << id() << ": only hash partitions (SparseTable) can be split.";
+
+    if (info_->replicated) {
+      cache_.resize(partitions_.size());
+      for (int i = 0; i < cache_.size(); ++i) {
+        cache_[i] = create_local(i);
+      }
+    }
   }
 
   int get_shard(const K& k);
   int get_shard_str(StringPiece k);
   V get_local(const K& k);
 
-  // Store the given key-value pair in this hash. If 'k' has affinity for a
-  // remote thread, the application occurs immediately on the local host,
-  // and the update is queued for transmission to the owner.
+  // Not supported: buffered puts to remote shards would reach the owner as
+  // updates, and be combined with its value instead of replacing it.  Use
+  // update, with a Replace accumulator if needed.
   void put(const K &k, const V &v);
   void update(const K &k, const V &v);
 
+  // As update, but for large values: if 'k' has no entry in the table or
+  // write buffer it updates, the contents of '*v' are swapped into a new
+  // slot rather than copied, and no default value is built for the slot.
+  // '*v' is left with whatever the slot held, e.g. the buffer of an entry
+  // cleared earlier, for reuse as scratch space.  V should have a swap
+  // overload which exchanges its buffers.
+  void take_update(const K &k, V *v);
+
   // Return the value associated with 'k', possibly blocking for a remote fetch.
   V get(const K &k);
   bool contains(const K &k);
   void remove(const K &k);
+
+  // As get, but return 'missing' if there is no entry for 'k'.  Looks up a
+  // local key only once.
+  V get_or(const K &k, const V &missing);
+
+  // Direct access to the value slot of a local key; see TypedTable.  The
+  // shard is not locked once find returns, so it may only be used without
+  // the apply thread.  Otherwise use LocalRef, which holds the shard lock
+  // while the slot is in use.  New entries are added with upsert.
+  V* find(const K &k);
+
+  // Call fn(V* v, bool inserted) on the value slot of local key 'k', holding
+  // the shard lock, inserting a default value first if there is none.
+  template <class F>
+  void upsert(const K &k, F fn);
+
+  // A read-only reference to the value of a local key, which must be
+  // present, for reading large values without copying them.  While it
+  // lives, the shard is locked against updates from other threads, and the
+  // kernel must not otherwise access the shard: with the apply thread on,
+  // the shard lock is held and is not re-entrant, so any get, update or
+  // other call on the shard deadlocks.  Without it, updates applied while
+  // the kernel waits may move the value.  Keep references short-lived.
+  class LocalRef : private boost::noncopyable {
+  public:
+    LocalRef(TypedGlobalTable<K, V> *t, const K &k) :
+      shard_(t->pin_shard(k)), lock_(t, shard_), v_(t->partition(shard_)->find(k)) {
+      CHECK(v_ != NULL) << "No entry for requested key: " << k;
+    }
+
+    const V& operator*() const { return *v_; }
+    const V* operator->() const { return v_; }
+
+  private:
+    int shard_;
+    KernelReadLock lock_;
+    const V* v_;
+  };
   TableIterator* get_iterator(int shard);
   TypedTable<K, V>* partition(int idx) {
-    return dynamic_cast<TypedTable<K, V>* >(partitions_[idx]);
+    return typed(partitions_[idx]);
   }
 
+  TypedTable<K, V>* replica(int idx) {
+    return dynamic_cast<TypedTable<K, V>* >(cache_[idx]);
+  }
+
+  // Iterators over a local shard see all of its data: if the shard is still
+  // arriving from its previous owner, wait for it.
   virtual TypedTableIterator<K, V>* get_typed_iterator(int shard) {
-    return static_cast<TypedTableIterator<K, V>* >(get_iterator(shard));
+    if (this->is_local_shard(shard)) {
+      WaitForMigration(shard);
+    }
+    TypedTableIterator<K, V>* it = static_cast<TypedTableIterator<K, V>* >(get_iterator(shard));
+    if (speculating_) {
+      return new SpeculativeIterator<K, V>(it, &cancelled_);
+    }
+    return it;
   }
 
+  // Iterate over the keys of local 'shard' changed by updates since the last
+  // changed iterator over the shard; keys changed from then on are left for
+  // the next.  The table must track changes.  Values are copies: store any
+  // changes with update.
+  TypedTableIterator<K, V>* get_changed_iterator(int shard);
+
+  // As get_changed_iterator, but take only the 'count' changed keys of
+  // 'shard' with the smallest priority under the table's Prioritizer,
+  // visiting them in priority order.  The remaining keys stay queued, for
+  // later iterators; only keys changed since the last call are scored
+  // again.
+  TypedTableIterator<K, V>* get_priority_iterator(int shard, int count);
+
+  // Iterate over the entries of 'shard' with keys in [lo, hi), in key order.
+  // The table's partitions must be ordered (e.g. SortedTable).
+  TypedTableIterator<K, V>* get_range_iterator(int shard, const K& lo, const K& hi);
+
 protected:
   LocalTable* create_local(int shard);
-};
 
-static const int kWriteFlushCount = 1000000;
+  // The shard of local key 'k', once all of it has arrived.
+  int pin_shard(const K &k) {
+    int shard = this->get_shard(k);
+    CHECK(is_local_shard(shard)) << " non-local for shard: " << shard;
+    WaitForMigration(shard);
+    return shard;
+  }
+
+  // Copy the value of 'k' in local 'shard', which has fully arrived, into
+  // '*v'.  Returns false if there is no entry for 'k'.
+  bool copy_local(int shard, const K &k, V *v) {
+    KernelReadLock sl(this, shard);
+    V* p = partition(shard)->find(k);
+    if (p == NULL) {
+      return false;
+    }
+    *v = *p;
+    return true;
+  }
+
+  // Combine '*v' into t's entry for 'k', swapping it in if there is none.
+  void swap_update(TypedTable<K, V> *t, const K &k, V *v) {
+    bool inserted;
+    V* slot = t->find_or_swap(k, v, &inserted);
+    if (!inserted) {
+      ((Accumulator<V>*)info_->accum)->Accumulate(slot, *v);
+    }
+  }
+
+  void combine_str(string *v, const StringPiece& other) {
+    Marshal<V>* m = (Marshal<V>*)info_->value_marshal;
+    V a, b;
+    m->unmarshal(*v, &a);
+    m->unmarshal(other, &b);
+    ((Accumulator<V>*)info_->accum)->Accumulate(&a, b);
+    v->clear();
+    m->marshal(a, v);
+  }
+
+  bool significant_update(const StringPiece& s) {
+    if (!boost::is_arithmetic<V>::value) {
+      return true;
+    }
+    V v;
+    ((Marshal<V>*)info_->value_marshal)->unmarshal(s, &v);
+    return magnitude(v, boost::is_arithmetic<V>()) >= info_->delta_threshold;
+  }
+
+  static TypedTable<K, V>* typed(LocalTable *t) {
+    return dynamic_cast<TypedTable<K, V>* >(t);
+  }
+
+  // If 'shard' is still arriving from its previous owner, wait until either
+  // 'k' or the whole shard has arrived.  Returns true, with the current
+  // value in 'v' if non-NULL, if 'k' arrived first.
+  bool get_migrating(int shard, const K& k, V* v);
 
+private:
+  // The inserted slot would be unlocked while other threads may read or
+  // move it; kernels use upsert instead.
+  V* find_or_insert(const K &k, bool *inserted) {
+    LOG(FATAL) << "Use upsert to insert into a global table.";
+    return NULL;
+  }
+
+  friend class ChangedIterator<K, V>;
+};
+
+// Iterates over a shard held by another worker.  Entries are fetched from
+// the owner in batches of kBatchSize.
 template<class K, class V>
 class RemoteIterator : public TypedTableIterator<K, V> {
 public:
+  static const int kBatchSize = 1024;
+
   RemoteIterator(GlobalTable *table, int shard) :
-    owner_(table), shard_(shard), done_(false) {
+    owner_(table), shard_(shard), index_(0) {
     request_.set_table(table->id());
     request_.set_shard(shard_);
-    int target_worker = table->get_partition_info(shard)->owner;
-
-    NetworkThread::Get()->Send(target_worker+1, MTYPE_ITERATOR_REQ, request_);
-    NetworkThread::Get()->Read(target_worker+1, MTYPE_ITERATOR_RESP, &response_);
+    request_.set_batch_size(kBatchSize);
+    Fetch();
+  }
 
-    request_.set_id(response_.id());
+  // Iterate over keys in [lo, hi) of an ordered table.
+  RemoteIterator(GlobalTable *table, int shard, const StringPiece& lo, const StringPiece& hi) :
+    owner_(table), shard_(shard), index_(0) {
+    request_.set_table(table->id());
+    request_.set_shard(shard_);
+    request_.set_batch_size(kBatchSize);
+    request_.set_lo(lo.data, lo.len);
+    request_.set_hi(hi.data, hi.len);
+    Fetch();
   }
 
   void key_str(string *out) {
-    *out = response_.key();
+    *out = response_.entries(index_).key();
   }
 
   void value_str(string *out) {
-    *out = response_.value();
+    *out = response_.entries(index_).value();
   }
 
   bool done() {
-    return response_.done();
+    return index_ >= response_.entries_size() && response_.done();
   }
 
   void Next() {
-    int target_worker = owner_->get_partition_info(shard_)->owner;
-    NetworkThread::Get()->Send(target_worker+1, MTYPE_ITERATOR_REQ, request_);
-    NetworkThread::Get()->Read(target_worker+1, MTYPE_ITERATOR_RESP, &response_);
     ++index_;
+    if (index_ >= response_.entries_size() && !response_.done()) {
+      Fetch();
+    }
   }
 
   const K& key() {
-    ((Marshal<K>*)(owner_->info().key_marshal))->unmarshal(response_.key(), &key_);
+    ((Marshal<K>*)(owner_->info().key_marshal))->unmarshal(response_.entries(index_).key(), &key_);
     return key_;
   }
 
   V& value() {
-    ((Marshal<V>*)(owner_->info().value_marshal))->unmarshal(response_.value(), &value_);
+    ((Marshal<V>*)(owner_->info().value_marshal))->unmarshal(response_.entries(index_).value(), &value_);
     return value_;
   }
 
 private:
+  void Fetch() {
+    int target_worker = owner_->get_partition_info(shard_)->owner;
+    NetworkThread::Get()->Send(target_worker+1, MTYPE_ITERATOR_REQ, request_);
+    NetworkThread::Get()->Read(target_worker+1, MTYPE_ITERATOR_RESP, &response_);
+    request_.set_id(response_.id());
+    request_.clear_lo();
+    request_.clear_hi();
+    index_ = 0;
+  }
+
   GlobalTable* owner_;
   IteratorRequest request_;
   IteratorResponse response_;
-  int id_;
 
   int shard_;
   int index_;
   K key_;
   V value_;
-  bool done_;
 };
 
 
+// Two tables with the same layout, for iterative computations: kernels
+// read the current table and write the next, and Master::swap_buffers
+// moves the next table's contents into the current one between kernels,
+// leaving the next table empty.  Table pointers stay valid across swaps.
+template <class K, class V>
+class DoubleBufferedTable : private boost::noncopyable {
+public:
+  DoubleBufferedTable(TypedGlobalTable<K, V> *current, TypedGlobalTable<K, V> *next) :
+    current_(current), next_(next) {}
+
+  TypedGlobalTable<K, V>* current() { return current_; }
+  TypedGlobalTable<K, V>* next() { return next_; }
+
+private:
+  TypedGlobalTable<K, V> *current_;
+  TypedGlobalTable<K, V> *next_;
+};
+
+// Iterates over a snapshot of the keys changed in a local shard, skipping
+// any no longer present.
+template<class K, class V>
+class ChangedIterator : public TypedTableIterator<K, V> {
+public:
+  ChangedIterator(TypedGlobalTable<K, V> *table, int shard) :
+    table_(table), shard_(shard), pos_(0) {
+    table->take_changed(shard, &keys_);
+    Load();
+  }
+
+  // Iterate over the given keys of 'shard', in order; 'keys' is cleared.
+  ChangedIterator(TypedGlobalTable<K, V> *table, int shard, vector<string>* keys) :
+    table_(table), shard_(shard), pos_(0) {
+    keys_.swap(*keys);
+    Load();
+  }
+
+  void key_str(string *out) { *out = keys_[pos_]; }
+
+  void value_str(string *out) {
+    ((Marshal<V>*)(table_->info().value_marshal))->marshal(value_, out);
+  }
+
+  bool done() { return pos_ >= keys_.size(); }
+
+  void Next() {
+    ++pos_;
+    Load();
+  }
+
+  const K& key() { return key_; }
+  V& value() { return value_; }
+
+private:
+  void Load() {
+    for (; pos_ < keys_.size(); ++pos_) {
+      ((Marshal<K>*)(table_->info().key_marshal))->unmarshal(keys_[pos_], &key_);
+      if (table_->copy_local(shard_, key_, &value_)) {
+        return;
+      }
+    }
+  }
+
+  TypedGlobalTable<K, V>* table_;
+  int shard_;
+  vector<string> keys_;
+  int pos_;
+  K key_;
+  V value_;
+};
+
 template<class K, class V>
 int TypedGlobalTable<K, V>::get_shard(const K& k) {
   DCHECK(this != NULL);
   DCHECK(this->info().sharder != NULL);
 
   Sharder<K> *sharder = (Sharder<K>*)(this->info().sharder);
-  int shard = (*sharder)(k, this->info().num_shards);
+  int shard = (*sharder)(k, base_shards_);
+  if (has_splits_) {
+    shard = split_child(shard,
+        split_hash(marshal(static_cast<Marshal<K>* >(this->info().key_marshal), k)));
+  }
   DCHECK_GE(shard, 0);
   DCHECK_LT(shard, this->num_shards());
   return shard;
@@ -212,48 +739,77 @@ V TypedGlobalTable<K, V>::get_local(const K& k) {
 
   CHECK(is_local_shard(shard)) << " non-local for shard: " << shard;
 
+  KernelReadLock sl(this, shard);
   return partition(shard)->get(k);
 }
 
-// Store the given key-value pair in this hash. If 'k' has affinity for a
-// remote thread, the application occurs immediately on the local host,
-// and the update is queued for transmission to the owner.
 template<class K, class V>
 void TypedGlobalTable<K, V>::put(const K &k, const V &v) {
   LOG(FATAL) << "Need to implement.";
-  int shard = this->get_shard(k);
-
-  //  boost::recursive_mutex::scoped_lock sl(mutex());
-  partition(shard)->put(k, v);
+}
 
-  if (!is_local_shard(shard)) {
-    ++pending_writes_;
-  }
+template<class K, class V>
+void TypedGlobalTable<K, V>::update(const K &k, const V &v) {
+  int shard = this->get_shard(k);
 
-  if (pending_writes_ > kWriteFlushCount) {
-    SendUpdates();
+  if (speculating_) {
+    typed(speculation_buffer(shard))->update(k, v);
+  } else if (is_local_shard(shard)) {
+    KernelWriteLock sl(this, shard);
+    if (tainted(shard)) {
+      typed(partinfo_[shard].migration_buffer)->update(k, v);
+    } else {
+      partition(shard)->update(k, v);
+    }
+    if (info_->track_changes) {
+      partinfo_[shard].changed.insert(marshal(static_cast<Marshal<K>* >(info_->key_marshal), k));
+    }
+  } else {
+    // Only entries new to the write buffer increase its size; updates to
+    // buffered keys are combined in place.  The shard lock is released
+    // before flushing, which locks each shard it sends.
+    int64_t added;
+    {
+      KernelWriteLock sl(this, shard);
+      int64_t entries = partitions_[shard]->size();
+      partition(shard)->update(k, v);
+      added = partitions_[shard]->size() - entries;
+    }
+    add_pending_bytes(shard, added * (ByteSize<K>::get(k) + ByteSize<V>::get(v)));
   }
 
-  PERIODIC(0.1, {this->HandlePutRequests();});
+  PERIODIC(0.1, {this->Poll();});
 }
 
 template<class K, class V>
-void TypedGlobalTable<K, V>::update(const K &k, const V &v) {
+void TypedGlobalTable<K, V>::take_update(const K &k, V *v) {
   int shard = this->get_shard(k);
 
-  //  boost::recursive_mutex::scoped_lock sl(mutex());
-  partition(shard)->update(k, v);
-
-//  LOG(INFO) << "local: " << k << " : " << is_local_shard(shard) << " : " << worker_id_;
-  if (!is_local_shard(shard)) {
-    ++pending_writes_;
-  }
-
-  if (pending_writes_ > kWriteFlushCount) {
-    SendUpdates();
+  if (speculating_) {
+    swap_update(typed(speculation_buffer(shard)), k, v);
+  } else if (is_local_shard(shard)) {
+    KernelWriteLock sl(this, shard);
+    if (tainted(shard)) {
+      swap_update(typed(partinfo_[shard].migration_buffer), k, v);
+    } else {
+      swap_update(partition(shard), k, v);
+    }
+    if (info_->track_changes) {
+      partinfo_[shard].changed.insert(marshal(static_cast<Marshal<K>* >(info_->key_marshal), k));
+    }
+  } else {
+    int64_t added;
+    int64_t bytes = ByteSize<K>::get(k) + ByteSize<V>::get(*v);
+    {
+      KernelWriteLock sl(this, shard);
+      int64_t entries = partitions_[shard]->size();
+      swap_update(partition(shard), k, v);
+      added = partitions_[shard]->size() - entries;
+    }
+    add_pending_bytes(shard, added * bytes);
   }
 
-  PERIODIC(0.1, {this->HandlePutRequests();});
+  PERIODIC(0.1, {this->Poll();});
 }
 
 // Return the value associated with 'k', possibly blocking for a remote fetch.
@@ -261,20 +817,27 @@ template<class K, class V>
 V TypedGlobalTable<K, V>::get(const K &k) {
   int shard = this->get_shard(k);
 
-  // If we received a get for this shard; but we haven't received all of the
-  // data for it yet. Continue reading from other workers until we do.
-  while (tainted(shard)) {
-    this->HandlePutRequests();
-    sched_yield();
-  }
-
-  PERIODIC(0.1, this->HandlePutRequests());
+  PERIODIC(0.1, this->Poll());
 
   if (is_local_shard(shard)) {
-    //    boost::recursive_mutex::scoped_lock sl(mutex());
+    V v;
+    if (get_migrating(shard, k, &v)) {
+      return v;
+    }
+
+    KernelReadLock sl(this, shard);
     return partition(shard)->get(k);
   }
 
+  // Replicas are only modified between kernels, so need no locking.
+  if (replicated()) {
+    return replica(shard)->get(k);
+  }
+
+  if (partinfo_[shard].snapshot) {
+    return typed(partinfo_[shard].snapshot)->get(k);
+  }
+
   string v_str;
   get_remote(shard,
              marshal(static_cast<Marshal<K>* >(this->info().key_marshal), k),
@@ -286,20 +849,106 @@ template<class K, class V>
 bool TypedGlobalTable<K, V>::contains(const K &k) {
   int shard = this->get_shard(k);
 
-  // If we received a request for this shard; but we haven't received all of the
-  // data for it yet. Continue reading from other workers until we do.
+  if (is_local_shard(shard)) {
+    if (get_migrating(shard, k, NULL)) {
+      return true;
+    }
+
+    KernelReadLock sl(this, shard);
+    return partition(shard)->contains(k);
+  }
+
+  if (replicated()) {
+    return replica(shard)->contains(k);
+  }
+
+  if (partinfo_[shard].snapshot) {
+    return typed(partinfo_[shard].snapshot)->contains(k);
+  }
+
+  string v_str;
+  return get_remote(shard, marshal(static_cast<Marshal<K>* >(info_->key_marshal), k), &v_str);
+}
+
+template<class K, class V>
+bool TypedGlobalTable<K, V>::get_migrating(int shard, const K& k, V* v) {
   while (tainted(shard)) {
+    {
+      boost::shared_lock<RWSpinLock> sl(shard_lock(shard));
+      if (tainted(shard) && partition(shard)->contains(k)) {
+        if (v) {
+          // Combine with any updates received since the migration started.
+          *v = partition(shard)->get(k);
+          TypedTable<K, V>* buffered = typed(partinfo_[shard].migration_buffer);
+          if (buffered->contains(k)) {
+            ((Accumulator<V>*)info_->accum)->Accumulate(v, buffered->get(k));
+          }
+        }
+        return true;
+      }
+    }
+
     this->HandlePutRequests();
     sched_yield();
   }
 
+  return false;
+}
+
+template<class K, class V>
+V TypedGlobalTable<K, V>::get_or(const K &k, const V &missing) {
+  int shard = this->get_shard(k);
+
+  PERIODIC(0.1, this->Poll());
+
   if (is_local_shard(shard)) {
-    //    boost::recursive_mutex::scoped_lock sl(mutex());
-    return partition(shard)->contains(k);
+    V v;
+    if (get_migrating(shard, k, &v)) {
+      return v;
+    }
+
+    KernelReadLock sl(this, shard);
+    V* p = partition(shard)->find(k);
+    return p ? *p : missing;
+  }
+
+  if (replicated() || partinfo_[shard].snapshot) {
+    TypedTable<K, V>* t = replicated() ? replica(shard) : typed(partinfo_[shard].snapshot);
+    V* p = t->find(k);
+    return p ? *p : missing;
   }
 
   string v_str;
-  return get_remote(shard, marshal(static_cast<Marshal<K>* >(info_->key_marshal), k), &v_str);
+  if (!get_remote(shard, marshal(static_cast<Marshal<K>* >(info_->key_marshal), k), &v_str)) {
+    return missing;
+  }
+  return unmarshal(static_cast<Marshal<V>* >(info_->value_marshal), v_str);
+}
+
+template<class K, class V>
+V* TypedGlobalTable<K, V>::find(const K &k) {
+  int shard = this->get_shard(k);
+  CHECK(is_local_shard(shard)) << " non-local for shard: " << shard;
+  CHECK(!threaded_apply_) << "Value slots may move under the apply thread; use LocalRef.";
+  WaitForMigration(shard);
+
+  return partition(shard)->find(k);
+}
+
+template<class K, class V>
+template <class F>
+void TypedGlobalTable<K, V>::upsert(const K &k, F fn) {
+  int shard = this->get_shard(k);
+  CHECK(is_local_shard(shard)) << " non-local for shard: " << shard;
+  CHECK(!speculating_) << "Speculative kernels cannot write value slots.";
+  WaitForMigration(shard);
+
+  KernelWriteLock sl(this, shard);
+  bool inserted;
+  fn(partition(shard)->find_or_insert(k, &inserted), inserted);
+  if (info_->track_changes) {
+    partinfo_[shard].changed.insert(marshal(static_cast<Marshal<K>* >(info_->key_marshal), k));
+  }
 }
 
 template<class K, class V>
@@ -321,11 +970,89 @@ template<class K, class V>
 TableIterator* TypedGlobalTable<K, V>::get_iterator(int shard) {
   if (this->is_local_shard(shard)) {
     return (TypedTableIterator<K, V>*) partitions_[shard]->get_iterator();
+  } else if (replicated()) {
+    return (TypedTableIterator<K, V>*) cache_[shard]->get_iterator();
+  } else if (partinfo_[shard].snapshot) {
+    return (TypedTableIterator<K, V>*) partinfo_[shard].snapshot->get_iterator();
   } else {
     return new RemoteIterator<K, V>(this, shard);
   }
 }
 
+template<class K, class V>
+TypedTableIterator<K, V>* TypedGlobalTable<K, V>::get_changed_iterator(int shard) {
+  CHECK(info_->track_changes) << "Table " << id() << " does not track changes.";
+  CHECK(is_local_shard(shard)) << "Changed keys of a remote shard: " << MP(id(), shard);
+  WaitForMigration(shard);
+
+  TypedTableIterator<K, V>* it = new ChangedIterator<K, V>(this, shard);
+  if (speculating_) {
+    return new SpeculativeIterator<K, V>(it, &cancelled_);
+  }
+  return it;
+}
+
+template<class K, class V>
+TypedTableIterator<K, V>* TypedGlobalTable<K, V>::get_priority_iterator(int shard, int count) {
+  CHECK(info_->priority != NULL) << "Table " << id() << " has no priority.";
+  CHECK(is_local_shard(shard)) << "Changed keys of a remote shard: " << MP(id(), shard);
+  WaitForMigration(shard);
+
+  vector<string> keys;
+  take_changed(shard, &keys);
+
+  // Rescore the keys changed since the last call; keys no longer in the
+  // shard leave the queue.
+  PartitionInfo *q = get_partition_info(shard);
+  Prioritizer<K, V>* p = (Prioritizer<K, V>*)info_->priority;
+  Marshal<K>* m = (Marshal<K>*)info_->key_marshal;
+  K k;
+  V v;
+  for (int i = 0; i < keys.size(); ++i) {
+    unordered_map<string, double>::iterator old = q->queued_priority.find(keys[i]);
+    if (old != q->queued_priority.end()) {
+      q->queued.erase(make_pair(old->second, keys[i]));
+      q->queued_priority.erase(old);
+    }
+
+    m->unmarshal(keys[i], &k);
+    if (copy_local(shard, k, &v)) {
+      double priority = (*p)(k, v);
+      q->queued.insert(make_pair(priority, keys[i]));
+      q->queued_priority[keys[i]] = priority;
+    }
+  }
+
+  vector<string> first;
+  while ((int)first.size() < count && !q->queued.empty()) {
+    first.push_back(q->queued.begin()->second);
+    q->queued_priority.erase(first.back());
+    q->queued.erase(q->queued.begin());
+  }
+
+  TypedTableIterator<K, V>* it = new ChangedIterator<K, V>(this, shard, &first);
+  if (speculating_) {
+    return new SpeculativeIterator<K, V>(it, &cancelled_);
+  }
+  return it;
+}
+
+template<class K, class V>
+TypedTableIterator<K, V>* TypedGlobalTable<K, V>::get_range_iterator(int shard, const K& lo, const K& hi) {
+  Marshal<K>* m = static_cast<Marshal<K>* >(this->info().key_marshal);
+  string lo_str = marshal(m, lo);
+  string hi_str = marshal(m, hi);
+
+  if (!this->is_local_shard(shard)) {
+    return new RemoteIterator<K, V>(this, shard, lo_str, hi_str);
+  }
+
+  WaitForMigration(shard);
+  OrderedTable *o = dynamic_cast<OrderedTable*>(partitions_[shard]);
+  CHECK(o != NULL) << "Range iteration requires an ordered table: " << MP(id(), shard);
+  return static_cast<TypedTableIterator<K, V>* >(o->get_range_iterator_str(lo_str, hi_str));
+}
+
 }
 
 #endif /* GLOBALTABLE_H_ */
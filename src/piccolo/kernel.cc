@@ -10,6 +10,7 @@ void DSMKernel::initialize_internal(Worker* w, int table_id, int shard) {
   w_ = w;
   table_id_ = table_id;
   shard_ = shard;
+  delta_ = 0;
 }
 
 void DSMKernel::set_args(const MarshalledMap& args) {
@@ -134,6 +134,10 @@ public:
   TypedGlobalTable<K, V>* get_table(int id) {
     return (TypedGlobalTable<K, V>*)get_table(id);
   }
+
+  // Add to the sum which Master::run_loop tests for convergence after each
+  // round, such as the number of keys changed.
+  void add_delta(double delta) { delta_ += delta; }
 private:
   friend class Worker;
   friend class Master;
@@ -149,6 +153,7 @@ private:
   int table_id_;
   MarshalledMap args_;
   MarshalledMap cp_;
+  double delta_;
 };
 
 struct KernelInfo {
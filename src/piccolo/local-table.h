@@ -15,6 +15,7 @@ class LocalTable :
   public UntypedTable {
 public:
   LocalTable() : delta_file_(NULL) {}
+  virtual ~LocalTable() {}
   bool empty() { return size() == 0; }
 
   void start_checkpoint(const string& f);
@@ -26,6 +27,16 @@ public:
   virtual void clear() = 0;
   virtual void resize(int64_t size) = 0;
 
+  // True if the entries of the shard can be divided among split shards by
+  // key hash: each serialized entry holds a single key, and the table keeps
+  // no key order.
+  virtual bool splittable() { return false; }
+
+  // Exchange contents with 'other', a shard of the same type.
+  virtual void swap(LocalTable *other) {
+    LOG(FATAL) << "Table " << id() << " does not support swapping shards.";
+  }
+
   virtual TableIterator* get_iterator() = 0;
 protected:
   friend class GlobalTable;
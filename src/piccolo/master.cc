@@ -1,18 +1,41 @@
 #include "piccolo/master.h"
+#include "piccolo/aggregator.h"
 #include "piccolo/table.h"
 #include "global-table.h"
 #include "local-table.h"
 
+#include <deque>
 #include <set>
+#include <limits>
 
 DEFINE_string(dead_workers, "", "For failure testing; comma delimited list of workers to pretend have died.");
 DEFINE_bool(work_stealing, true, "Enable work stealing to load-balance tasks between machines.");
 DEFINE_bool(checkpoint, false, "If true, enable checkpointing.");
 DEFINE_bool(restore, false, "If true, enable restore.");
+DEFINE_double(split_factor, 4.0,
+              "Split shards of splittable tables that hold this many times the "
+              "average number of entries, or whose tasks take this many times "
+              "the average task time.");
+DEFINE_int64(min_split_entries, 10000, "Never split shards with fewer entries than this.");
+DEFINE_bool(balance_tasks, true,
+            "Before running a kernel, move tasks from workers with the "
+            "largest predicted load to those with the smallest, using the "
+            "runtimes of earlier runs of the kernel on each shard.");
+DEFINE_double(balance_slack, 0.25,
+              "Stop balancing tasks once the predicted loads of all workers "
+              "are within this fraction of the average load.");
+DEFINE_double(backup_factor, 3.0,
+              "For speculative kernels, start a backup copy of a task on an "
+              "idle worker once it has run this many times the average task time.");
+DEFINE_int32(task_queue_depth, 2,
+             "Number of tasks a worker may have outstanding at once; tasks "
+             "beyond the first wait in a queue on the worker.");
 
 DECLARE_string(checkpoint_write_dir);
 DECLARE_string(checkpoint_read_dir);
 DECLARE_double(sleep_time);
+DECLARE_bool(aggregate_host_updates);
+DECLARE_int32(control_fanout);
 
 namespace dsm {
 
@@ -37,7 +60,8 @@ struct TaskState : private boost::noncopyable {
   };
 
   TaskState(Taskid id, int64_t size)
-    : id(id), status(PENDING), size(size), stolen(false) {}
+    : id(id), status(PENDING), size(size), cost(size), stolen(false), runtime(-1),
+      cancelling(false), steal_to(-1), backup(-1), dispatch_time(0) {}
 
   static bool IdCompare(TaskState *a, TaskState *b) {
     return a->id < b->id;
@@ -50,20 +74,68 @@ struct TaskState : private boost::noncopyable {
     return a->size < b->size;
   }
 
+  // Order in which a worker runs its pending tasks: tasks it has not stolen
+  // first, then by decreasing cost.  Ties are broken by id, so the order is
+  // total and can key a set.  The stolen flag and cost of a queued task must
+  // not change.
+  struct QueueOrder {
+    bool operator()(TaskState *a, TaskState *b) const {
+      if (a->stolen != b->stolen) {
+        return b->stolen;
+      }
+      if (a->cost != b->cost) {
+        return a->cost > b->cost;
+      }
+      return a->id < b->id;
+    }
+  };
+
   Taskid id;
   int status;
   int size;
+
+  // Predicted running time: seconds if the kernel has run on this table
+  // before, otherwise the number of entries in the shard.
+  double cost;
   bool stolen;
+
+  // Time taken to run the task, once finished.
+  double runtime;
+
+  // Set while the master is asking the worker to give up this task, which
+  // it will give to worker 'steal_to' if it has not started.
+  bool cancelling;
+  int steal_to;
+
+  // The worker running a backup copy of this task, if any.
+  int backup;
+  double dispatch_time;
 };
 
 typedef map<Taskid, TaskState*> TaskMap;
+typedef std::set<TaskState*, TaskState::QueueOrder> TaskQueue;
 typedef std::set<Taskid> ShardSet;
+
+// The master's view of a worker.  Pending tasks are kept in a queue in the
+// order they will be run, and the number and cost of tasks in each state are
+// maintained as tasks change state, so that scheduling decisions do not
+// need to scan the tasks of each worker.  All task state changes must go
+// through the methods below.
 struct WorkerState : private boost::noncopyable {
   WorkerState(int w_id) : id(w_id) {
     last_ping_time = Now();
     last_task_start = 0;
     total_runtime = 0;
     checkpointing = false;
+    num_finished_ = 0;
+    pending_cost_ = 0;
+    last_finish = 0;
+    backup_task = NULL;
+    backup_owner = -1;
+  }
+
+  ~WorkerState() {
+    clear_tasks();
   }
 
   TaskMap work;
@@ -81,10 +153,17 @@ struct WorkerState : private boost::noncopyable {
 
   bool checkpointing;
 
-  // Order by number of pending tasks and last update time.
+  // Time the last task assigned to this worker finished.
+  double last_finish;
+
+  // A backup copy of another worker's task, being run by this worker.
+  TaskState* backup_task;
+  int backup_owner;
+
+  // Order by number of tasks not yet started.
   static bool PendingCompare(WorkerState *a, WorkerState* b) {
 //    return (a->pending_size() < b->pending_size());
-    return a->num_pending() < b->num_pending();
+    return a->num_waiting() < b->num_waiting();
   }
 
   bool alive() const {
@@ -103,7 +182,7 @@ struct WorkerState : private boost::noncopyable {
     // Wait a little while before stealing work; should really be
     // using something like the standard deviation, but this works
     // for now.
-    if (num_finished() != work.size())
+    if (num_finished() != work.size() || backup_task != NULL)
       return 0;
 
     return Now() - last_ping_time;
@@ -127,79 +206,160 @@ struct WorkerState : private boost::noncopyable {
     return shards.find(id) != shards.end();
   }
 
+  // Take ownership of a pending task.
   void assign_task(TaskState *s) {
+    CHECK_EQ(s->status, TaskState::PENDING);
     work[s->id] = s;
+    queue_.insert(s);
+    pending_cost_ += s->cost;
   }
 
+  // Give up a pending task, without deleting it.
   void remove_task(TaskState* s) {
+    CHECK_EQ(s->status, TaskState::PENDING);
     work.erase(work.find(s->id));
+    queue_.erase(s);
+    pending_cost_ -= s->cost;
   }
 
   void clear_tasks() {
+    for (TaskMap::iterator i = work.begin(); i != work.end(); ++i) {
+      delete i->second;
+    }
     work.clear();
+    queue_.clear();
+    in_flight_.clear();
+    num_finished_ = 0;
+    pending_cost_ = 0;
   }
 
-  void set_finished(const Taskid& id) {
+  void set_finished(const Taskid& id, double runtime) {
     CHECK(work.find(id) != work.end());
     TaskState *t = work[id];
     CHECK(t->status == TaskState::ACTIVE);
     t->status = TaskState::FINISHED;
+    t->runtime = runtime;
+    in_flight_.erase(std::find(in_flight_.begin(), in_flight_.end(), t));
+    ++num_finished_;
+    last_finish = Now();
   }
 
-#define COUNT_TASKS(name, type)\
-  int num_ ## name() const {\
-    int c = 0;\
-    for (TaskMap::const_iterator i = work.begin(); i != work.end(); ++i)\
-      if (i->second->status == TaskState::type) { ++c; }\
-    return c;\
-  }\
-  int64_t name ## _size() const {\
-      int64_t c = 0;\
-      for (TaskMap::const_iterator i = work.begin(); i != work.end(); ++i)\
-        if (i->second->status == TaskState::type) { c += i->second->size; }\
-      return c;\
-  }\
-  vector<TaskState*> name() const {\
-    vector<TaskState*> out;\
-    for (TaskMap::const_iterator i = work.begin(); i != work.end(); ++i)\
-      if (i->second->status == TaskState::type) { out.push_back(i->second); }\
-    return out;\
-  }
-
-  COUNT_TASKS(pending, PENDING)
-  COUNT_TASKS(active, ACTIVE)
-  COUNT_TASKS(finished, FINISHED)
-#undef COUNT_TASKS
+  // Return a dispatched task the worker gave back to the pending queue.
+  void requeue(TaskState* t) {
+    CHECK(t->status == TaskState::ACTIVE);
+    in_flight_.erase(std::find(in_flight_.begin(), in_flight_.end(), t));
+    t->status = TaskState::PENDING;
+    queue_.insert(t);
+    pending_cost_ += t->cost;
+  }
 
-  int num_assigned() const { return work.size(); }
-  int64_t total_size() const {
-    int64_t out = 0;
-    for (TaskMap::const_iterator i = work.begin(); i != work.end(); ++i) {
-      out += 1 + i->second->size;
+  int64_t shard_entries(TableRegistry::Map& tables) const {
+    int64_t c = 0;
+    for (ShardSet::const_iterator i = shards.begin(); i != shards.end(); ++i) {
+      c += tables[i->table]->shard_size(i->shard);
     }
+    return c;
+  }
+
+  int num_pending() const { return queue_.size(); }
+  int num_active() const { return in_flight_.size(); }
+  int num_finished() const { return num_finished_; }
+  double pending_cost() const { return pending_cost_; }
+
+  // Tasks which have not started: those pending, and those dispatched
+  // behind the one the worker is running.
+  int num_waiting() const {
+    return num_pending() + max(0, num_active() - 1);
+  }
+
+  double waiting_cost() const {
+    double c = pending_cost_;
+    for (int i = 1; i < in_flight_.size(); ++i) {
+      c += in_flight_[i]->cost;
+    }
+    return c;
+  }
+
+  // The pending task to run next, or NULL if there is none.
+  TaskState* next_pending() const {
+    return queue_.empty() ? NULL : *queue_.begin();
+  }
+
+  // The most costly pending task not stolen and costing less than 'limit',
+  // or NULL if there is none.
+  TaskState* largest_pending_below(double limit) const {
+    for (TaskQueue::const_iterator i = queue_.begin(); i != queue_.end(); ++i) {
+      if (!(*i)->stolen && (*i)->cost < limit) {
+        return *i;
+      }
+    }
+    return NULL;
+  }
+
+  // The task the worker is running, if any, and how long it has run for.
+  // The worker starts a task when it has finished those sent before it.
+  TaskState* running() const {
+    return in_flight_.empty() ? NULL : in_flight_.front();
+  }
+
+  double running_time() const {
+    return Now() - max(in_flight_.front()->dispatch_time, last_finish);
+  }
+
+  // The most recently dispatched task, if it is queued on the worker
+  // behind another task.
+  TaskState* last_queued() const {
+    return in_flight_.size() > 1 ? in_flight_.back() : NULL;
+  }
+
+  vector<TaskState*> finished() const {
+    vector<TaskState*> out;
+    for (TaskMap::const_iterator i = work.begin(); i != work.end(); ++i)
+      if (i->second->status == TaskState::FINISHED) { out.push_back(i->second); }
     return out;
   }
 
+  int num_assigned() const { return work.size(); }
+
+  // Remove the next pending task from the queue and mark it active.
+  TaskState* start_next() {
+    TaskState* best = next_pending();
+    if (best == NULL) {
+      return NULL;
+    }
+
+    queue_.erase(queue_.begin());
+    pending_cost_ -= best->cost;
+    in_flight_.push_back(best);
+
+    best->status = TaskState::ACTIVE;
+    best->dispatch_time = Now();
+    last_task_start = Now();
+    return best;
+  }
+
   // Order pending tasks by our guess of how large they are
   bool get_next(const RunDescriptor& r, KernelRequest* msg) {
-    vector<TaskState*> p = pending();
-
-    if (p.empty()) {
+    TaskState* best = start_next();
+    if (best == NULL) {
       return false;
     }
 
-    TaskState* best = *max_element(p.begin(), p.end(), &TaskState::WeightCompare);
-
     msg->set_kernel(r.kernel);
     msg->set_method(r.method);
     msg->set_table(r.table->id());
     msg->set_shard(best->id.shard);
-
-    best->status = TaskState::ACTIVE;
-    last_task_start = Now();
-
     return true;
   }
+
+private:
+  TaskQueue queue_;
+
+  // Dispatched tasks which have not finished, in the order they were sent.
+  // The worker runs them in this order.
+  std::deque<TaskState*> in_flight_;
+  int num_finished_;
+  double pending_cost_;
 };
 
 Master::Master(const ConfigData &conf) :
@@ -208,6 +368,10 @@ Master::Master(const ConfigData &conf) :
   checkpoint_epoch_ = 0;
   kernel_epoch_ = 0;
   finished_ = dispatched_ = 0;
+  avg_task_cost_ = 1;
+  copies_running_ = 0;
+  cost_is_time_ = false;
+  cancels_pending_ = 0;
   last_checkpoint_ = Now();
   checkpointing_ = false;
   network_ = NetworkThread::Get();
@@ -219,15 +383,21 @@ Master::Master(const ConfigData &conf) :
     workers_.push_back(new WorkerState(i));
   }
 
+  vector<string> hosts(config_.num_workers());
   for (int i = 0; i < config_.num_workers(); ++i) {
     RegisterWorkerRequest req;
     int src = 0;
     network_->Read(MPI::ANY_SOURCE, MTYPE_REGISTER_WORKER, &req, &src);
+    hosts[src - 1] = req.hostname();
     VLOG(1) << "Registered worker " << src - 1 << "; " << config_.num_workers() - 1 - i << " remaining.";
   }
 
   LOG(INFO) << "All workers registered; starting up.";
 
+  if (FLAGS_aggregate_host_updates) {
+    assign_host_aggregators(hosts);
+  }
+
   vector<StringPiece> bits = StringPiece::split(FLAGS_dead_workers, ",");
 //  LOG(INFO) << "dead workers: " << FLAGS_dead_workers;
   for (int i = 0; i < bits.size(); ++i) {
@@ -236,6 +406,22 @@ Master::Master(const ConfigData &conf) :
   }
 }
 
+// The lowest numbered worker on each host combines the updates of workers on
+// that host for workers elsewhere.
+void Master::assign_host_aggregators(const vector<string>& hosts) {
+  map<string, int> host_aggregator;
+  HostAggregators req;
+  for (int i = 0; i < hosts.size(); ++i) {
+    if (host_aggregator.find(hosts[i]) == host_aggregator.end()) {
+      host_aggregator[hosts[i]] = i;
+    }
+    req.add_aggregator(host_aggregator[hosts[i]]);
+  }
+
+  LOG(INFO) << "Aggregating updates on " << host_aggregator.size() << " hosts.";
+  network_->SyncBroadcast(MTYPE_HOST_AGGREGATORS, MTYPE_HOST_AGGREGATORS_DONE, req);
+}
+
 Master::~Master() {
   LOG(INFO) << "Total runtime: " << runtime_.elapsed();
 
@@ -249,6 +435,11 @@ Master::~Master() {
   }
   fprintf(stderr, "\n");
 
+  if (barrier_latency_.getCount() > 0) {
+    LOG(INFO) << "Barrier latency over " << workers_.size() << " workers:\n"
+              << barrier_latency_.summary();
+  }
+
   LOG(INFO) << "Kernel stats: ";
   for (MethodStatsMap::iterator i = method_stats_.begin(); i != method_stats_.end(); ++i) {
      LOG(INFO) << i->first << "--> " << i->second.ShortDebugString();
@@ -433,11 +624,9 @@ WorkerState* Master::worker_for_shard(int table, int shard) {
 
 WorkerState* Master::assign_worker(int table, int shard) {
   WorkerState* ws = worker_for_shard(table, shard);
-  int64_t work_size = tables_[table]->shard_size(shard);
 
   if (ws) {
 //    LOG(INFO) << "Worker for shard: " << MP(table, shard, ws->id);
-    ws->assign_task(new TaskState(Taskid(table, shard), work_size));
     return ws;
   }
 
@@ -456,27 +645,102 @@ WorkerState* Master::assign_worker(int table, int shard) {
 
   VLOG(1) << "Assigning " << MP(table, shard) << " to " << best->id;
   best->assign_shard(shard, true);
-  best->assign_task(new TaskState(Taskid(table, shard), work_size));
   return best;
 }
 
+// Send the assignments which changed since they were last sent.
 void Master::send_table_assignments() {
   ShardAssignmentRequest req;
 
   for (int i = 0; i < workers_.size(); ++i) {
     WorkerState& w = *workers_[i];
     for (ShardSet::iterator j = w.shards.begin(); j != w.shards.end(); ++j) {
+      int& sent = sent_owners_.insert(make_pair(make_pair(j->table, j->shard), -1)).first->second;
+      if (sent == i) {
+        continue;
+      }
+      sent = i;
+
       ShardAssignment* s  = req.add_assign();
       s->set_new_worker(i);
       s->set_table(j->table);
       s->set_shard(j->shard);
 //      s->set_old_worker(-1);
+
+      // Track owners in our copy of the tables as well, so shard sizes are
+      // taken from the reported partition info.
+      tables_[j->table]->get_partition_info(j->shard)->owner = i;
     }
   }
 
+  if (req.assign_size() == 0) {
+    return;
+  }
+
+  VLOG(1) << "Sending " << req.assign_size() << " shard assignments.";
   network_->SyncBroadcast(MTYPE_SHARD_ASSIGNMENT, MTYPE_SHARD_ASSIGNMENT_DONE, req);
 }
 
+// The flush and apply rounds of a barrier.  Messages pass down a tree of
+// workers, and replies are combined on the way up, so the master exchanges
+// messages only with its children.  The apply round completes once every
+// worker has received as many updates as were sent to it before the flush.
+// Aggregator partial values are combined along with the update counts.
+void Master::flush_and_apply(bool finish_aggregates, bool send_held) {
+  Timer t;
+  vector<int> children;
+  for (int r = 1; r <= FLAGS_control_fanout && r < network_->size(); ++r) {
+    children.push_back(r);
+  }
+
+  FlushRequest flush;
+  flush.set_send_held(send_held);
+  for (int i = 0; i < children.size(); ++i) {
+    network_->Send(children[i], MTYPE_WORKER_FLUSH, flush);
+  }
+
+  ApplyRequest apply;
+  for (int j = 0; j < workers_.size(); ++j) {
+    apply.add_puts_expected(0);
+  }
+
+  AggregatorRegistry::Map &aggs = AggregatorRegistry::Get()->aggregators();
+  FlushResponse flushed;
+  for (int i = 0; i < children.size(); ++i) {
+    network_->Read(children[i], MTYPE_WORKER_FLUSH_DONE, &flushed);
+    for (int j = 0; j < workers_.size(); ++j) {
+      apply.set_puts_expected(j, apply.puts_expected(j) + flushed.puts_sent(j));
+    }
+    for (int j = 0; j < flushed.partials_size(); ++j) {
+      aggs[flushed.partials(j).id()]->merge_partial(flushed.partials(j).value());
+    }
+  }
+
+  if (finish_aggregates) {
+    for (AggregatorRegistry::Map::iterator i = aggs.begin(); i != aggs.end(); ++i) {
+      string total;
+      i->second->finish(&total);
+      if (i->second->broadcast()) {
+        AggregatorData* a = apply.add_totals();
+        a->set_id(i->first);
+        a->set_value(total);
+      }
+    }
+  }
+
+  for (int i = 0; i < children.size(); ++i) {
+    network_->Send(children[i], MTYPE_WORKER_APPLY, apply);
+  }
+  EmptyMessage empty;
+  for (int i = 0; i < children.size(); ++i) {
+    network_->Read(children[i], MTYPE_WORKER_APPLY_DONE, &empty);
+  }
+
+  barrier_latency_.add(t.elapsed());
+  MethodStats &mstats = method_stats_[current_run_.kernel + ":" + current_run_.method];
+  mstats.set_barrier_time(mstats.barrier_time() + t.elapsed());
+}
+
 bool Master::steal_work(const RunDescriptor& r, int idle_worker,
                         double avg_completion_time) {
   if (!FLAGS_work_stealing) {
@@ -489,52 +753,215 @@ bool Master::steal_work(const RunDescriptor& r, int idle_worker,
     return false;
   }
 
-  // Find the worker with the largest number of pending tasks.
+  // Find the worker with the largest number of tasks waiting to start.
   WorkerState& src = **max_element(workers_.begin(), workers_.end(), &WorkerState::PendingCompare);
-  if (src.num_pending() == 0) {
+  if (src.num_waiting() == 0) {
     return false;
   }
 
-  vector<TaskState*> pending = src.pending();
+  // Prefer a task the master has not yet sent; otherwise, take back the last
+  // task sent to the worker, if it is still queued there.
+  TaskState *task = src.next_pending();
+  if (task == NULL) {
+    task = src.last_queued();
+    if (task == NULL || task->cancelling) {
+      return false;
+    }
+  }
 
-  TaskState *task = *max_element(pending.begin(), pending.end(), TaskState::WeightCompare);
   if (task->stolen) {
     return false;
   }
 
-  double average_size = 0;
+  // Weight the cost of moving the table versus the time savings.  The time
+  // left on the source is estimated from the predicted cost of its waiting
+  // tasks, as at least one task interval per task.
+  double seconds = cost_is_time_ ? 1.0 : avg_completion_time / avg_task_cost_;
+  double move_cost = max(1.0, 2 * task->cost * seconds);
+  double eta = max((double)src.num_waiting(), src.waiting_cost() * seconds);
 
-  for (int i = 0; i < r.table->num_shards(); ++i) {
-    average_size += r.table->shard_size(i);
-  }
-  average_size /= r.table->num_shards();
+//  LOG(INFO) << "ETA: " << eta << " move cost: " << move_cost;
 
-  // Weight the cost of moving the table versus the time savings.
-  double move_cost = max(1.0,
-                         2 * task->size * avg_completion_time / average_size);
-  double eta = 0;
-  for (int i = 0; i < pending.size(); ++i) {
-    TaskState *p = pending[i];
-    eta += max(1.0, p->size * avg_completion_time / average_size);
+  if (eta <= move_cost) {
+    return false;
   }
 
-//  LOG(INFO) << "ETA: " << eta << " move cost: " << move_cost;
+  if (task->status == TaskState::ACTIVE) {
+    // The task moves once the worker confirms it has not started it.
+    task->cancelling = true;
+    task->steal_to = idle_worker;
+    ++cancels_pending_;
 
-  if (eta <= move_cost) {
+    KernelCancel req;
+    req.set_table(task->id.table);
+    req.set_shard(task->id.shard);
+    network_->Send(src.id + 1, MTYPE_CANCEL_KERNEL, req);
     return false;
   }
 
-  const Taskid& tid = task->id;
-  task->stolen = true;
+  move_task(src, dst, task);
+  return true;
+}
+
+void Master::move_task(WorkerState& src, WorkerState& dst, TaskState* task) {
+  const Taskid tid = task->id;
 
-  LOG(INFO) << "Worker " << idle_worker << " is stealing task "
+  LOG(INFO) << "Worker " << dst.id << " is stealing task "
             << MP(tid.shard, task->size) << " from worker " << src.id;
-  dst.assign_shard(tid.shard, true);
-  src.assign_shard(tid.shard, false);
 
+  move_shards(src, dst, tid.shard);
   src.remove_task(task);
+  task->stolen = true;
   dst.assign_task(task);
-  return true;
+}
+
+// Move the shard of every table co-located with the given shard.  Split
+// tables may have placed a shard with the same number elsewhere.
+void Master::move_shards(WorkerState& src, WorkerState& dst, int shard) {
+  for (TableRegistry::Map::iterator i = tables_.begin(); i != tables_.end(); ++i) {
+    Taskid id(i->first, shard);
+    if (src.serves(id)) {
+      src.shards.erase(id);
+      dst.shards.insert(id);
+    }
+  }
+}
+
+bool Master::reap_cancelled_tasks() {
+  bool moved = false;
+  KernelCancel done;
+  int w_id = 0;
+  while (network_->TryRead(MPI::ANY_SOURCE, MTYPE_CANCEL_KERNEL_DONE, &done, &w_id)) {
+    WorkerState& w = *workers_[w_id - 1];
+    TaskState* task = w.work[Taskid(done.table(), done.shard())];
+    CHECK(task->cancelling);
+    task->cancelling = false;
+    --cancels_pending_;
+
+    // A task the worker had already started finishes there as usual.
+    if (!done.cancelled()) {
+      continue;
+    }
+
+    w.requeue(task);
+    --dispatched_;
+    move_task(w, *workers_[task->steal_to], task);
+    moved = true;
+  }
+  return moved;
+}
+
+// Split shards of splittable tables that are much larger than average, or
+// whose tasks in the kernel just run took much longer than average.  Every
+// worker applies the same splits, leaving each new shard on the worker that
+// held its parent; new shards are then moved to the workers holding the
+// fewest entries, using the usual shard migration.
+void Master::split_shards() {
+  ShardSplitRequest req;
+  for (TableRegistry::Map::iterator i = tables_.begin(); i != tables_.end(); ++i) {
+    GlobalTable *t = i->second;
+    if (t->info().max_shards <= t->num_shards()) {
+      continue;
+    }
+
+    double avg_size = 0;
+    for (int j = 0; j < t->num_shards(); ++j) {
+      avg_size += t->shard_size(j);
+    }
+    avg_size /= t->num_shards();
+
+    map<int, double> task_times;
+    double avg_time = 0;
+    if (current_run_.table == t) {
+      for (int j = 0; j < workers_.size(); ++j) {
+        vector<TaskState*> done = workers_[j]->finished();
+        for (int k = 0; k < done.size(); ++k) {
+          task_times[done[k]->id.shard] = done[k]->runtime;
+          avg_time += done[k]->runtime;
+        }
+      }
+      avg_time /= max((int)task_times.size(), 1);
+    }
+
+    vector<pair<int64_t, int> > candidates;
+    for (int j = 0; j < t->num_shards(); ++j) {
+      int64_t size = t->shard_size(j);
+      if (size < FLAGS_min_split_entries) {
+        continue;
+      }
+
+      bool big = size > FLAGS_split_factor * avg_size;
+      bool slow = task_times.size() > 1 && task_times.find(j) != task_times.end() &&
+                  task_times[j] > FLAGS_split_factor * avg_time;
+      if (big || slow) {
+        candidates.push_back(make_pair(size, j));
+      }
+    }
+
+    std::sort(candidates.rbegin(), candidates.rend());
+    for (int j = 0; j < candidates.size() && t->num_shards() < t->info().max_shards; ++j) {
+      int shard = candidates[j].second;
+      WorkerState *w = worker_for_shard(t->id(), shard);
+      CHECK(w != NULL);
+
+      int child = t->split_shard(shard);
+
+      ShardSplit *s = req.add_split();
+      s->set_table(t->id());
+      s->set_shard(shard);
+      s->set_child(child);
+
+      // Assume an even split until the owner reports the actual sizes.
+      ShardInfo si;
+      si.set_table(t->id());
+      si.set_owner(w->id);
+      si.set_entries(candidates[j].first / 2);
+      si.set_shard(shard);
+      t->UpdatePartitions(si);
+      si.set_shard(child);
+      t->UpdatePartitions(si);
+
+      w->shards.insert(Taskid(t->id(), child));
+    }
+  }
+
+  if (req.split_size() == 0) {
+    return;
+  }
+
+  LOG(INFO) << "Splitting " << req.split_size() << " shards.";
+  network_->SyncBroadcast(MTYPE_SHARD_SPLIT, MTYPE_SHARD_SPLIT_DONE, req);
+
+  vector<int64_t> load(workers_.size());
+  for (int i = 0; i < workers_.size(); ++i) {
+    load[i] = workers_[i]->alive() ? workers_[i]->shard_entries(tables_)
+                                    : std::numeric_limits<int64_t>::max();
+  }
+
+  bool moved = false;
+  for (int i = 0; i < req.split_size(); ++i) {
+    const ShardSplit &s = req.split(i);
+    Taskid child(s.table(), s.child());
+    WorkerState *src = worker_for_shard(s.table(), s.child());
+    WorkerState *dst = workers_[min_element(load.begin(), load.end()) - load.begin()];
+    int64_t size = tables_[s.table()]->shard_size(s.child());
+
+    if (dst != src && load[dst->id] + size < load[src->id]) {
+      VLOG(1) << "Moving split shard " << MP(s.table(), s.child()) << " to " << dst->id;
+      src->shards.erase(child);
+      dst->shards.insert(child);
+      load[src->id] -= size;
+      load[dst->id] += size;
+      moved = true;
+    }
+  }
+
+  if (moved) {
+    send_table_assignments();
+
+    // Complete the migration of moved shards before the next kernel.
+    flush_and_apply(false);
+  }
 }
 
 void Master::assign_tables() {
@@ -549,31 +976,129 @@ void Master::assign_tables() {
   }
 }
 
+// Predict the cost of each task from the runtimes of earlier runs of the
+// kernel method on the same shards.  Shards without a recorded runtime, such
+// as new shards from splits, are assumed to take time in proportion to
+// their size.  If the method has never run on this table, the cost of each
+// task is the size of its shard.
 void Master::assign_tasks(const RunDescriptor& r, vector<int> shards) {
   for (int i = 0; i < workers_.size(); ++i) {
     WorkerState& w = *workers_[i];
-    w.clear_tasks(); //XXX: did not delete task state, memory leak
+    w.clear_tasks();
+  }
+
+  const int table = r.table->id();
+  ShardTimes& history = shard_times_[r.kernel + ":" + r.method];
+
+  double known_time = 0, known_size = 0;
+  for (int i = 0; i < shards.size(); ++i) {
+    ShardTimes::iterator h = history.find(make_pair(table, shards[i]));
+    if (h != history.end()) {
+      known_time += h->second;
+      known_size += 1 + r.table->shard_size(shards[i]);
+    }
   }
+  cost_is_time_ = known_size > 0;
 
+  // Task costs are fixed for the duration of the kernel, so their average
+  // is computed once for use by work stealing.
+  avg_task_cost_ = 0;
   for (int i = 0; i < shards.size(); ++i) {
-    assign_worker(r.table->id(), shards[i]);
+    int64_t size = r.table->shard_size(shards[i]);
+    TaskState* t = new TaskState(Taskid(table, shards[i]), size);
+
+    ShardTimes::iterator h = history.find(make_pair(table, shards[i]));
+    if (h != history.end()) {
+      t->cost = h->second;
+    } else if (cost_is_time_) {
+      t->cost = (1 + size) * known_time / known_size;
+    }
+
+    avg_task_cost_ += t->cost;
+    assign_worker(table, shards[i])->assign_task(t);
+  }
+  avg_task_cost_ = max(1e-6, avg_task_cost_ / max((int)shards.size(), 1));
+
+  if (FLAGS_balance_tasks && cost_is_time_) {
+    balance_tasks();
+  }
+}
+
+// Balance the predicted load of workers before any task starts.  Tasks are
+// moved, largest first, from the most loaded worker to the least loaded
+// while that lowers the larger of the two loads.  This converges to a
+// longest-processing-time-first schedule without moving shards needlessly.
+// Moved shards are migrated like stolen ones.
+void Master::balance_tasks() {
+  vector<int> alive;
+  double total = 0;
+  for (int i = 0; i < workers_.size(); ++i) {
+    if (workers_[i]->alive()) {
+      alive.push_back(i);
+      total += workers_[i]->pending_cost();
+    }
+  }
+
+  if (alive.size() < 2) {
+    return;
+  }
+
+  const double slack = FLAGS_balance_slack * total / alive.size();
+  int moved = 0;
+  for (int round = 0; round < current_run_.shards.size(); ++round) {
+    WorkerState* src = workers_[alive[0]];
+    WorkerState* dst = src;
+    for (int i = 1; i < alive.size(); ++i) {
+      WorkerState* w = workers_[alive[i]];
+      if (w->pending_cost() > src->pending_cost()) { src = w; }
+      if (w->pending_cost() < dst->pending_cost()) { dst = w; }
+    }
+
+    double gap = src->pending_cost() - dst->pending_cost();
+    if (gap <= slack) {
+      break;
+    }
+
+    TaskState* task = src->largest_pending_below(gap);
+    if (task == NULL) {
+      break;
+    }
+
+    VLOG(1) << "Moving task " << MP(task->id.shard, task->cost)
+            << " from worker " << src->id << " to " << dst->id;
+    move_shards(*src, *dst, task->id.shard);
+    src->remove_task(task);
+    dst->assign_task(task);
+    ++moved;
+  }
+
+  if (moved > 0) {
+    LOG(INFO) << "Moved " << moved << " tasks to balance predicted load.";
+    send_table_assignments();
   }
 }
 
+// Keep up to --task_queue_depth tasks outstanding on each worker, so a
+// worker can start its next task without waiting for the master.
 int Master::dispatch_work(const RunDescriptor& r) {
   int num_dispatched = 0;
   KernelRequest w_req;
+  Args* p = NULL;
+  w_req.set_speculative(r.speculative);
+  w_req.set_epoch(kernel_epoch_);
   for (int i = 0; i < workers_.size(); ++i) {
     WorkerState& w = *workers_[i];
-    if (w.num_pending() > 0 && w.num_active() == 0) {
+    while (w.num_pending() > 0 && w.num_active() < max(1, FLAGS_task_queue_depth)) {
+      if (p == NULL) {
+        p = r.params.ToMessage();
+        w_req.mutable_args()->CopyFrom(*p);
+      }
       w.get_next(r, &w_req);
-      Args* p = r.params.ToMessage();
-      w_req.mutable_args()->CopyFrom(*p);
-      delete p;
       num_dispatched++;
       network_->Send(w.id + 1, MTYPE_RUN_KERNEL, w_req);
     }
   }
+  delete p;
   return num_dispatched;
 }
 
@@ -617,12 +1142,42 @@ int Master::reap_one_task() {
       tables_[si.table()]->UpdatePartitions(si);
     }
 
-    w.set_finished(task_id);
+    // Tasks may wait in a queue on the worker before they start, so use the
+    // runtime the worker measured.
+    double runtime = done_msg.has_runtime() ? done_msg.runtime() : Now() - w.last_task_start;
+    w.total_runtime += runtime;
+    w.ping();
+
+    const KernelRequest& k = done_msg.kernel();
+    WorkerState* owner = &w;
+    if (k.backup()) {
+      CHECK(w.backup_task != NULL);
+      owner = workers_[w.backup_owner];
+      w.backup_task = NULL;
+    }
+
+    CHECK(owner->is_assigned(task_id));
+    TaskState* task = owner->work[task_id];
+    if (k.speculative()) {
+      if (task->status == TaskState::FINISHED) {
+        // Another copy finished first; this one was told to abort.
+        --copies_running_;
+        return -1;
+      }
+      commit_task(w, task, k.backup() ? owner->id : task->backup);
+    }
+
+    owner->set_finished(task_id, runtime);
+
+    // Remember the runtime to predict the cost of the next run on this
+    // shard, smoothing out noise between runs.
+    ShardTimes& history = shard_times_[current_run_.kernel + ":" + current_run_.method];
+    pair<int, int> shard_key(task_id.table, task_id.shard);
+    ShardTimes::iterator h = history.find(shard_key);
+    history[shard_key] = h == history.end() ? runtime : 0.5 * (h->second + runtime);
 
-    w.total_runtime += Now() - w.last_task_start;
-    mstats.set_shard_time(mstats.shard_time() + Now() - w.last_task_start);
+    mstats.set_shard_time(mstats.shard_time() + runtime);
     mstats.set_shard_calls(mstats.shard_calls() + 1);
-    w.ping();
     return w_id;
   } else {
     Sleep(FLAGS_sleep_time);
@@ -631,6 +1186,86 @@ int Master::reap_one_task() {
 
 }
 
+// The first copy of a speculative task to finish keeps its updates; the
+// other copy, if there is one, is told to abort and discard its own.
+void Master::commit_task(WorkerState& winner, TaskState* task, int other) {
+  TaskCommit c;
+  c.set_table(task->id.table);
+  c.set_shard(task->id.shard);
+  c.set_commit(true);
+  network_->Send(winner.id + 1, MTYPE_TASK_COMMIT, c);
+
+  if (other < 0) {
+    return;
+  }
+
+  c.set_commit(false);
+  network_->Send(other + 1, MTYPE_TASK_COMMIT, c);
+  ++copies_running_;
+
+  if (winner.id == task->backup) {
+    MethodStats &mstats = method_stats_[current_run_.kernel + ":" + current_run_.method];
+    mstats.set_backup_wins(mstats.backup_wins() + 1);
+  }
+  VLOG(1) << "Task " << MP(task->id.table, task->id.shard) << " finished first on "
+          << winner.id << "; aborting the copy on " << other;
+}
+
+// Start a copy of the longest running task on an idle worker, if that task
+// has run for much longer than the average task.  The copy reads a snapshot
+// of the task's shard, taken from its owner.
+bool Master::launch_backup(WorkerState& idle, double avg_completion_time) {
+  if (!idle.alive() || idle.backup_task != NULL) {
+    return false;
+  }
+
+  // Tasks much shorter than a second are not worth copying.
+  double threshold = max(1.0, FLAGS_backup_factor * avg_completion_time);
+  WorkerState* owner = NULL;
+  for (int i = 0; i < workers_.size(); ++i) {
+    WorkerState& w = *workers_[i];
+    TaskState* t = w.running();
+    if (&w == &idle || t == NULL || t->backup >= 0) {
+      continue;
+    }
+
+    double elapsed = w.running_time();
+    if (elapsed > threshold) {
+      owner = &w;
+      threshold = elapsed;
+    }
+  }
+
+  if (owner == NULL) {
+    return false;
+  }
+
+  TaskState* task = owner->running();
+  KernelRequest req;
+  req.set_kernel(current_run_.kernel);
+  req.set_method(current_run_.method);
+  req.set_table(task->id.table);
+  req.set_shard(task->id.shard);
+  req.set_speculative(true);
+  req.set_backup(true);
+  req.set_epoch(kernel_epoch_);
+  Args* p = current_run_.params.ToMessage();
+  req.mutable_args()->CopyFrom(*p);
+  delete p;
+
+  network_->Send(idle.id + 1, MTYPE_RUN_KERNEL, req);
+  task->backup = idle.id;
+  idle.backup_task = task;
+  idle.backup_owner = owner->id;
+
+  MethodStats &mstats = method_stats_[current_run_.kernel + ":" + current_run_.method];
+  mstats.set_backups(mstats.backups() + 1);
+  LOG(INFO) << "Worker " << idle.id << " is running a backup of task "
+            << MP(task->id.table, task->id.shard) << " from worker " << owner->id
+            << " after " << threshold << " seconds.";
+  return true;
+}
+
 void Master::run(RunDescriptor r) {
   if (!FLAGS_checkpoint && r.checkpoint_type != CP_NONE) {
     LOG(INFO) << "Checkpoint is disabled by flag.";
@@ -670,9 +1305,10 @@ void Master::run(RunDescriptor r) {
 
   kernel_epoch_++;
 
+  double schedule_start = Now();
   assign_tasks(current_run_, shards);
-
   dispatched_ = dispatch_work(current_run_);
+  mstats.set_schedule_time(mstats.schedule_time() + Now() - schedule_start);
 
   //XXX:in its current state, does not make sense not to call barrier at the end
 //  if (r.barrier) {
@@ -680,6 +1316,299 @@ void Master::run(RunDescriptor r) {
 //  }
 }
 
+// A task of a run in a graph.
+struct GraphTask {
+  int run;
+  int shard;
+  int worker;
+
+  // Tasks this one depends on, the number of them yet to finish, and the
+  // tasks which depend on this one.
+  vector<int> deps;
+  int waiting;
+  vector<int> dependents;
+
+  // Updates sent by the task's worker to each worker once it finished.
+  vector<int64_t> puts_sent;
+};
+
+void Master::run_graph(RunGraph g) {
+  CHECK_EQ(current_run_.shards.size(), finished_) << " Cannot start kernel before previous one is finished ";
+  CHECK(!FLAGS_aggregate_host_updates) << "Graphs of runs do not support host aggregators.";
+  CHECK(!g.runs_.empty());
+
+  if (!shards_assigned_) {
+    assign_tables();
+    send_table_assignments();
+  }
+
+  kernel_epoch_++;
+  double start = Now();
+
+  vector<GraphTask> tasks;
+  vector<map<int, int> > run_tasks(g.runs_.size());
+  vector<int> remaining(g.runs_.size());
+  vector<Args*> args(g.runs_.size());
+  for (int r = 0; r < g.runs_.size(); ++r) {
+    RunDescriptor& run = g.runs_[r];
+    KernelInfo *k = KernelRegistry::Get()->kernel(run.kernel);
+    CHECK_NE(run.table, (void*)NULL) << "Table locality must be specified!";
+    CHECK_NE(k, (void*)NULL) << "Invalid kernel class " << run.kernel;
+    CHECK_EQ(k->has_method(run.method), true) << "Invalid method: " << MP(run.kernel, run.method);
+
+    if (run.shards.empty()) {
+      run.shards = range(run.table->num_shards());
+    }
+
+    MethodStats &mstats = method_stats_[run.kernel + ":" + run.method];
+    mstats.set_calls(mstats.calls() + 1);
+
+    args[r] = run.params.ToMessage();
+    remaining[r] = run.shards.size();
+    for (int i = 0; i < run.shards.size(); ++i) {
+      GraphTask t;
+      t.run = r;
+      t.shard = run.shards[i];
+      t.worker = worker_for_shard(run.table->id(), t.shard)->id;
+      t.waiting = 0;
+      run_tasks[r][t.shard] = tasks.size();
+      tasks.push_back(t);
+    }
+  }
+
+  for (int i = 0; i < g.deps_.size(); ++i) {
+    const RunGraph::Dependency& d = g.deps_[i];
+    for (map<int, int>::iterator j = run_tasks[d.run].begin(); j != run_tasks[d.run].end(); ++j) {
+      GraphTask& t = tasks[j->second];
+      for (map<int, int>::iterator k = run_tasks[d.dep].begin(); k != run_tasks[d.dep].end(); ++k) {
+        if (d.per_shard && k->first != j->first) {
+          continue;
+        }
+        t.deps.push_back(k->second);
+        tasks[k->second].dependents.push_back(j->second);
+        ++t.waiting;
+      }
+    }
+  }
+
+  vector<std::deque<int> > ready(workers_.size());
+  vector<int> active(workers_.size(), 0);
+  for (int i = 0; i < tasks.size(); ++i) {
+    if (tasks[i].waiting == 0) {
+      ready[tasks[i].worker].push_back(i);
+    }
+  }
+
+  int finished = 0;
+  while (finished < tasks.size()) {
+    for (int w = 0; w < workers_.size(); ++w) {
+      while (!ready[w].empty() && active[w] < max(1, FLAGS_task_queue_depth)) {
+        int id = ready[w].front();
+        ready[w].pop_front();
+        GraphTask& t = tasks[id];
+        const RunDescriptor& run = g.runs_[t.run];
+
+        KernelRequest req;
+        req.set_kernel(run.kernel);
+        req.set_method(run.method);
+        req.set_table(run.table->id());
+        req.set_shard(t.shard);
+        req.mutable_args()->CopyFrom(*args[t.run]);
+        req.set_epoch(kernel_epoch_);
+        req.set_graph_task(id);
+
+        if (!t.deps.empty()) {
+          vector<int64_t> wait(workers_.size(), 0);
+          for (int j = 0; j < t.deps.size(); ++j) {
+            const GraphTask& dep = tasks[t.deps[j]];
+            wait[dep.worker] = max(wait[dep.worker], dep.puts_sent[w]);
+          }
+          for (int j = 0; j < wait.size(); ++j) {
+            req.add_wait_puts(wait[j]);
+          }
+        }
+
+        ++active[w];
+        network_->Send(w + 1, MTYPE_RUN_KERNEL, req);
+      }
+    }
+
+    KernelDone done;
+    int w_id = 0;
+    if (!network_->TryRead(MPI::ANY_SOURCE, MTYPE_KERNEL_DONE, &done, &w_id)) {
+      Sleep(FLAGS_sleep_time);
+      continue;
+    }
+
+    w_id -= 1;
+    --active[w_id];
+    ++finished;
+    workers_[w_id]->ping();
+
+    for (int i = 0; i < done.shards_size(); ++i) {
+      const ShardInfo &si = done.shards(i);
+      tables_[si.table()]->UpdatePartitions(si);
+    }
+
+    GraphTask& t = tasks[done.kernel().graph_task()];
+    t.puts_sent.assign(done.puts_sent().begin(), done.puts_sent().end());
+    for (int i = 0; i < t.dependents.size(); ++i) {
+      GraphTask& next = tasks[t.dependents[i]];
+      if (--next.waiting == 0) {
+        ready[next.worker].push_back(t.dependents[i]);
+      }
+    }
+
+    const RunDescriptor& run = g.runs_[t.run];
+    MethodStats &mstats = method_stats_[run.kernel + ":" + run.method];
+    mstats.set_shard_time(mstats.shard_time() + done.runtime());
+    mstats.set_shard_calls(mstats.shard_calls() + 1);
+    if (--remaining[t.run] == 0) {
+      mstats.set_total_time(mstats.total_time() + Now() - start);
+      LOG(INFO) << "Kernel '" << run.method << "' finished in " << Now() - start
+                << " as part of a graph of " << g.runs_.size() << " runs.";
+    }
+  }
+
+  for (int r = 0; r < args.size(); ++r) {
+    delete args[r];
+  }
+
+  current_run_ = g.runs_.back();
+  finished_ = dispatched_ = current_run_.shards.size();
+
+  flush_and_apply(true);
+
+  refresh_replicas();
+
+  LOG(INFO) << "Graph of " << g.runs_.size() << " runs finished in " << Now() - start;
+}
+
+void Master::run_iterations(RunDescriptor r, int iterations, int staleness) {
+  CHECK_GE(staleness, 0);
+
+  RunGraph g;
+  for (int k = 0; k < iterations; ++k) {
+    RunDescriptor round = r;
+    round.params.put<int>("iteration", k);
+    g.add(round);
+
+    if (k > 0) {
+      g.add_shard_dependency(k, k - 1);
+    }
+    if (k > staleness) {
+      g.add_dependency(k, k - staleness - 1);
+    }
+  }
+
+  run_graph(g);
+}
+
+int Master::run_loop(RunDescriptor r, int max_rounds, double converged) {
+  CHECK_EQ(current_run_.shards.size(), finished_) << " Cannot start kernel before previous one is finished ";
+  CHECK(!FLAGS_aggregate_host_updates) << "Loops do not support host aggregators.";
+  CHECK_GT(max_rounds, 0);
+
+  KernelInfo *k = KernelRegistry::Get()->kernel(r.kernel);
+  CHECK_NE(r.table, (void*)NULL) << "Table locality must be specified!";
+  CHECK_NE(k, (void*)NULL) << "Invalid kernel class " << r.kernel;
+  CHECK_EQ(k->has_method(r.method), true) << "Invalid method: " << MP(r.kernel, r.method);
+
+  if (!shards_assigned_) {
+    assign_tables();
+    send_table_assignments();
+  }
+
+  kernel_epoch_++;
+  r.shards = range(r.table->num_shards());
+  current_run_ = r;
+  current_run_start_ = Now();
+  finished_ = dispatched_ = 0;
+
+  MethodStats &mstats = method_stats_[r.kernel + ":" + r.method];
+  mstats.set_calls(mstats.calls() + 1);
+
+  // Every worker takes part in the reductions between rounds, including
+  // those without shards to run on.
+  Args* p = r.params.ToMessage();
+  for (int i = 0; i < workers_.size(); ++i) {
+    KernelRequest req;
+    req.set_kernel(r.kernel);
+    req.set_method(r.method);
+    req.set_table(r.table->id());
+    req.mutable_args()->CopyFrom(*p);
+    req.set_epoch(kernel_epoch_);
+    req.set_max_rounds(max_rounds);
+    req.set_converged(converged);
+    for (int j = 0; j < r.shards.size(); ++j) {
+      if (worker_for_shard(r.table->id(), r.shards[j])->id == i) {
+        req.add_loop_shards(r.shards[j]);
+      }
+    }
+    network_->Send(i + 1, MTYPE_RUN_KERNEL, req);
+  }
+  delete p;
+  dispatched_ = r.shards.size();
+
+  int rounds = 0;
+  double delta = 0;
+  for (int done_count = 0; done_count < workers_.size(); ) {
+    KernelDone done;
+    int w_id = 0;
+    if (!network_->TryRead(MPI::ANY_SOURCE, MTYPE_KERNEL_DONE, &done, &w_id)) {
+      Sleep(FLAGS_sleep_time);
+      continue;
+    }
+
+    ++done_count;
+    workers_[w_id - 1]->ping();
+    for (int i = 0; i < done.shards_size(); ++i) {
+      tables_[done.shards(i).table()]->UpdatePartitions(done.shards(i));
+    }
+
+    rounds = done.rounds();
+    delta = done.delta();
+    mstats.set_shard_time(mstats.shard_time() + done.runtime());
+    mstats.set_shard_calls(mstats.shard_calls() + rounds * done.kernel().loop_shards_size());
+  }
+  finished_ = r.shards.size();
+
+  // Every update has been applied by the last round; this collects the
+  // contributions to aggregators.
+  flush_and_apply(true);
+  refresh_replicas();
+
+  mstats.set_total_time(mstats.total_time() + Now() - current_run_start_);
+  LOG(INFO) << "Kernel '" << r.method << "' finished " << rounds << " rounds in "
+            << Now() - current_run_start_ << "; final delta " << delta;
+  return rounds;
+}
+
+void Master::refresh_replicas() {
+  EmptyMessage empty;
+  for (TableRegistry::Map::iterator i = tables_.begin(); i != tables_.end(); ++i) {
+    if (i->second->replicated()) {
+      network_->SyncBroadcast(MTYPE_WORKER_REPLICATE, MTYPE_WORKER_REPLICATE_DONE, empty);
+      break;
+    }
+  }
+}
+
+void Master::swap_tables(GlobalTable *current, GlobalTable *next) {
+  SwapTablesRequest req;
+  req.set_current(current->id());
+  req.set_next(next->id());
+  network_->SyncBroadcast(MTYPE_SWAP_TABLES, MTYPE_SWAP_TABLES_DONE, req);
+}
+
+void Master::flush_held_updates() {
+  flush_and_apply(false, true);
+  if (FLAGS_aggregate_host_updates) {
+    flush_and_apply(false, true);
+  }
+  refresh_replicas();
+}
+
 void Master::cp_barrier() {
   current_run_.checkpoint_type = CP_MASTER_CONTROLLED;
   barrier();
@@ -699,10 +1628,28 @@ void Master::barrier() {
       checkpoint();
     }
 
+    if (cancels_pending_ > 0 && reap_cancelled_tasks()) {
+      send_table_assignments();
+    }
+
+    if (current_run_.speculative && mstats.shard_calls() > 0) {
+      PERIODIC(0.5, {
+            double backup_start = Now();
+            double avg_completion_time = mstats.shard_time() / mstats.shard_calls();
+            for (int i = 0; i < workers_.size(); ++i) {
+              if (workers_[i]->idle_time() > 0.5) {
+                launch_backup(*workers_[i], avg_completion_time);
+              }
+            }
+            mstats.set_schedule_time(mstats.schedule_time() + Now() - backup_start);
+          });
+    }
+
     if (reap_one_task() >= 0) {
       finished_++;
 
       PERIODIC(0.1, {
+            double steal_start = Now();
             double avg_completion_time =
             mstats.shard_time() / mstats.shard_calls();
 
@@ -729,6 +1676,8 @@ void Master::barrier() {
 
             }
 
+            mstats.set_schedule_time(mstats.schedule_time() + Now() - steal_start);
+
             if (need_update) {
               // Update the table assignments.
               send_table_assignments();
@@ -737,19 +1686,40 @@ void Master::barrier() {
           });
 
       if (dispatched_ < current_run_.shards.size()) {
+        double dispatch_start = Now();
         dispatched_ += dispatch_work(current_run_);
+        mstats.set_schedule_time(mstats.schedule_time() + Now() - dispatch_start);
       }
     }
 
   }
 
-  EmptyMessage empty;
-  //1st round-trip to make sure all workers have flushed everything
-  network_->SyncBroadcast(MTYPE_WORKER_FLUSH, MTYPE_WORKER_FLUSH_DONE, empty);
+  // Collect the answers to cancellations of tasks that have since finished,
+  // so they are not mistaken for answers in the next kernel.
+  while (cancels_pending_ > 0) {
+    CHECK(!reap_cancelled_tasks()) << "Cancelled a task after the kernel finished.";
+    Sleep(FLAGS_sleep_time);
+  }
+
+  // Wait for aborted copies of speculative tasks to stop, so that their
+  // workers can take part in the flush.
+  while (copies_running_ > 0) {
+    CHECK_LT(reap_one_task(), 0) << "Task finished twice.";
+  }
 
-  //2nd round-trip to make sure all workers have applied all updates
-  //XXX: incorrect if MPI does not guarantee remote delivery
-  network_->SyncBroadcast(MTYPE_WORKER_APPLY, MTYPE_WORKER_APPLY_DONE, empty);
+  // Make sure all workers have sent and applied all updates.
+  flush_and_apply(!FLAGS_aggregate_host_updates);
+
+  // Host aggregators now hold the combined updates of their host; repeat
+  // both rounds to deliver them to their owners.
+  if (FLAGS_aggregate_host_updates) {
+    flush_and_apply(true);
+  }
+
+  //3rd round-trip to refresh the worker replicas of replicated tables
+  refresh_replicas();
+
+  split_shards();
 
   if (current_run_.checkpoint_type == CP_MASTER_CONTROLLED) {
     if (!checkpointing_) {
@@ -759,7 +1729,8 @@ void Master::barrier() {
   }
 
   mstats.set_total_time(mstats.total_time() + Now() - current_run_start_);
-  LOG(INFO) << "Kernel '" << current_run_.method << "' finished in " << Now() - current_run_start_;
+  LOG(INFO) << "Kernel '" << current_run_.method << "' finished in " << Now() - current_run_start_
+            << "; " << mstats.schedule_time() << " seconds spent scheduling in total.";
 }
 
 static void TestTaskSort() {
@@ -772,6 +1743,24 @@ static void TestTaskSort() {
   for (int i = 1; i < 100; ++i) {
     CHECK_LE(t[i-1]->size, t[i]->size);
   }
+
+  // A worker runs its own tasks largest first, then the tasks it stole.
+  WorkerState w(0);
+  for (int i = 0; i < 100; ++i) {
+    t[i]->stolen = i % 10 == 0;
+    w.assign_task(t[i]);
+  }
+  CHECK_EQ(w.num_pending(), 100);
+
+  TaskState* last = w.start_next();
+  for (int i = 1; i < 100; ++i) {
+    TaskState* next = w.start_next();
+    CHECK(last->stolen == next->stolen ? last->cost >= next->cost : next->stolen);
+    last = next;
+  }
+  CHECK(w.start_next() == NULL);
+  CHECK_EQ(w.num_active(), 100);
+  CHECK_EQ(w.pending_cost(), 0);
 }
 
 REGISTER_TEST(TaskSort, TestTaskSort());
@@ -28,6 +28,11 @@ struct RunDescriptor {
 
    int epoch;
 
+   // If true, the kernel method is idempotent: the master may run a backup
+   // copy of a slow task elsewhere, keeping the updates of whichever copy
+   // finishes first.
+   bool speculative;
+
    // Key-value map of arguments to pass to kernel functions
    MarshalledMap params;
 
@@ -47,6 +52,7 @@ struct RunDescriptor {
              GlobalTable *table,
              vector<int> cp_tables=vector<int>()) {
      barrier = true;
+     speculative = false;
      checkpoint_type = CP_NONE;
      checkpoint_interval = -1;
      checkpoint_tables = cp_tables;
@@ -61,6 +67,49 @@ struct RunDescriptor {
    }
  };
 
+// A set of kernel runs with dependencies between them.  Master::run_graph
+// starts each task as soon as the tasks it depends on have finished, rather
+// than after a barrier at the end of each run.
+class RunGraph {
+public:
+  // Add a run to the graph, returning its index.  Runs which do not list
+  // their shards run on all shards of their table.
+  int add(const RunDescriptor& r) {
+    runs_.push_back(r);
+    return runs_.size() - 1;
+  }
+
+  // Each shard of 'run' may start once the same shard of the earlier run
+  // 'dep' has finished.
+  void add_shard_dependency(int run, int dep) {
+    add_dependency(run, dep, true);
+  }
+
+  // 'run' may start once every shard of the earlier run 'dep' has finished.
+  void add_dependency(int run, int dep) {
+    add_dependency(run, dep, false);
+  }
+
+private:
+  friend class Master;
+
+  struct Dependency {
+    int run;
+    int dep;
+    bool per_shard;
+  };
+
+  void add_dependency(int run, int dep, bool per_shard) {
+    CHECK_LT(dep, run) << "Runs may only depend on earlier runs.";
+    CHECK_LT(run, runs_.size());
+    Dependency d = { run, dep, per_shard };
+    deps_.push_back(d);
+  }
+
+  vector<RunDescriptor> runs_;
+  vector<Dependency> deps_;
+};
+
 class Master {
 public:
   Master(const ConfigData &conf);
@@ -88,6 +137,30 @@ public:
 
   void run(RunDescriptor r);
 
+  // Blocking.  Run a graph of kernels, with a barrier only at the end.
+  // Before a task starts, its worker applies the updates which the tasks it
+  // depends on sent to it, so the task sees their updates to the shards of
+  // its own worker; reads of other shards may not yet see them.  Tasks run
+  // on the owners of their shards, without work stealing, backup tasks or
+  // checkpoints.
+  void run_graph(RunGraph g);
+
+  // Blocking.  Run 'iterations' rounds of a kernel, passing the round in the
+  // "iteration" argument.  Rather than waiting for every shard after each
+  // round, a shard may run up to 'staleness' rounds ahead of the slowest
+  // shard; before round k, a shard's worker has applied all updates from
+  // rounds up to k - staleness - 1.  A staleness of 0 gives the usual
+  // rounds, without the barrier after each.
+  void run_iterations(RunDescriptor r, int iterations, int staleness);
+
+  // Blocking.  Run a kernel method over all shards in rounds, passing the
+  // round in the "round" argument, until the sum of the deltas reported by
+  // DSMKernel::add_delta in a round falls below 'converged', or for
+  // 'max_rounds' rounds.  The workers synchronize between rounds among
+  // themselves; the master takes part only at the start and end.  Returns
+  // the number of rounds run.
+  int run_loop(RunDescriptor r, int max_rounds, double converged);
+
   template <class T>
   T& get_cp_var(const string& key, T defval=T()) {
     if (!cp_vars_.contains(key)) {
@@ -100,6 +173,20 @@ public:
   void barrier();
   void cp_barrier();
 
+  // Blocking.  Between kernels, move the contents of 'next' into 'current'
+  // on every worker, and clear 'next'.  See DoubleBufferedTable.
+  template <class K, class V>
+  void swap_buffers(DoubleBufferedTable<K, V> *t) {
+    swap_tables(t->current(), t->next());
+  }
+
+  void swap_tables(GlobalTable *current, GlobalTable *next);
+
+  // Blocking.  Send the updates held back by tables' delta thresholds, and
+  // wait until they are applied.  Call once a computation using thresholds
+  // has converged; run_loop does so itself.
+  void flush_held_updates();
+
   // Blocking.  Instruct workers to save table and kernel state.
   // When this call returns, all requested tables in the system will have been
   // committed to disk.
@@ -117,15 +204,33 @@ private:
 
   WorkerState* worker_for_shard(int table, int shard);
 
-  // Find a worker to run a kernel on the given table and shard.  If a worker
-  // already serves the given shard, return it.  Otherwise, find an eligible
-  // worker and assign it to them.
+  // Find a worker to serve the given table and shard.  If a worker already
+  // serves the given shard, return it.  Otherwise, find an eligible worker
+  // and assign it to them.
   WorkerState* assign_worker(int table, int shard);
 
   void send_table_assignments();
+  // If 'finish_aggregates' is true, aggregator totals are computed from
+  // the partial values gathered, and broadcast where requested.  If
+  // 'send_held' is true, updates held back by delta thresholds are sent.
+  void flush_and_apply(bool finish_aggregates, bool send_held=false);
+  void refresh_replicas();
+  void assign_host_aggregators(const vector<string>& hosts);
+  void split_shards();
   bool steal_work(const RunDescriptor& r, int idle_worker, double avg_time);
+  void move_task(WorkerState& src, WorkerState& dst, TaskState* task);
+  void move_shards(WorkerState& src, WorkerState& dst, int shard);
+
+  // Handle replies to requests to cancel tasks queued on workers, moving
+  // cancelled tasks to the workers stealing them.  Returns true if any shards
+  // were moved.
+  bool reap_cancelled_tasks();
+
+  bool launch_backup(WorkerState& idle, double avg_completion_time);
+  void commit_task(WorkerState& winner, TaskState* task, int other);
   void assign_tables();
   void assign_tasks(const RunDescriptor& r, vector<int> shards);
+  void balance_tasks();
   int dispatch_work(const RunDescriptor& r);
 
   void dump_stats();
@@ -140,6 +245,17 @@ private:
   RunDescriptor current_run_;
   double current_run_start_;
   int dispatched_; //# of dispatched tasks
+
+  // Average predicted cost of the tasks of the current kernel, and whether
+  // costs are in seconds rather than entries.
+  double avg_task_cost_;
+  bool cost_is_time_;
+
+  // Number of cancel requests sent to workers and not yet answered.
+  int cancels_pending_;
+
+  // Number of aborted copies of speculative tasks still running.
+  int copies_running_;
   int finished_; //# of finished tasks
 
   bool shards_assigned_;
@@ -154,6 +270,16 @@ private:
   typedef map<string, MethodStats> MethodStatsMap;
   MethodStatsMap method_stats_;
 
+  // The owner of each (table, shard) last sent to the workers.
+  map<pair<int, int>, int> sent_owners_;
+
+  // Time taken by each flush and apply round.
+  Histogram barrier_latency_;
+
+  // Smoothed runtime of each kernel method on each (table, shard).
+  typedef map<pair<int, int>, double> ShardTimes;
+  map<string, ShardTimes> shard_times_;
+
   TableRegistry::Map& tables_;
   NetworkThread* network_;
   Timer runtime_;
@@ -80,6 +80,7 @@ NetworkThread::NetworkThread() {
   for (int i = 0; i < kMaxMethods; ++i) {
     callbacks_[i] = NULL;
   }
+  memset(sent_count_, 0, sizeof(sent_count_));
 }
 
 bool NetworkThread::active() const {
@@ -168,14 +169,18 @@ void NetworkThread::Run() {
       Sleep(FLAGS_sleep_time);
     }
 
-    while (!pending_sends_.empty()) {
+    // Start sends in the order they were queued; MPI then delivers the
+    // messages to each peer in that order.
+    if (!pending_sends_.empty()) {
       boost::recursive_mutex::scoped_lock sl(send_lock);
-      RPCRequest* s = pending_sends_.back();
-      pending_sends_.pop_back();
-      s->start_time = Now();
-      s->mpi_req = world_->Isend(
-          s->payload.data(), s->payload.size(), MPI::BYTE, s->target, s->rpc_type);
-      active_sends_.insert(s);
+      for (int i = 0; i < pending_sends_.size(); ++i) {
+        RPCRequest* s = pending_sends_[i];
+        s->start_time = Now();
+        s->mpi_req = world_->Isend(
+            s->payload.data(), s->payload.size(), MPI::BYTE, s->target, s->rpc_type);
+        active_sends_.insert(s);
+      }
+      pending_sends_.clear();
     }
 
     CollectActive();
@@ -237,9 +242,15 @@ void NetworkThread::Send(RPCRequest *req) {
 //    LOG(INFO) << "Sending... " << MP(req->target, req->rpc_type);
   stats["bytes_sent"] += req->payload.size();
   stats[StringPrintf("sends.%s", MessageTypes_Name((MessageTypes)(req->rpc_type)).c_str())] += 1;
+  ++sent_count_[req->rpc_type][req->target];
   pending_sends_.push_back(req);
 }
 
+int64_t NetworkThread::sent_count(int dst, int method) const {
+  boost::recursive_mutex::scoped_lock sl(send_lock);
+  return sent_count_[method][dst];
+}
+
 void NetworkThread::Send(int dst, int method, const Message &msg) {
   RPCRequest *r = new RPCRequest(dst, method, msg);
   Send(r);
@@ -39,6 +39,9 @@ public:
   void Flush();
   void Shutdown();
 
+  // Number of messages of the given type sent to 'dst' so far.
+  int64_t sent_count(int dst, int method) const;
+
   int id() { return id_; }
   int size() const;
 
@@ -53,7 +56,7 @@ public:
   Stats stats;
 private:
   static const int kMaxHosts = 512;
-  static const int kMaxMethods = 36;
+  static const int kMaxMethods = 40;
 
   typedef deque<string> Queue;
 
@@ -64,6 +67,7 @@ private:
   unordered_set<RPCRequest*> active_sends_;
 
   Queue incoming[kMaxMethods][kMaxHosts];
+  int64_t sent_count_[kMaxMethods][kMaxHosts];
 
   MPI::Comm *world_;
   mutable boost::recursive_mutex send_lock;
@@ -0,0 +1,348 @@
+#ifndef SORTED_TABLE_H_
+#define SORTED_TABLE_H_
+
+#include "piccolo/common.h"
+#include "piccolo/worker.pb.h"
+#include "piccolo/table.h"
+#include "local-table.h"
+#include <algorithm>
+#include <math.h>
+#include <boost/noncopyable.hpp>
+
+namespace dsm {
+
+// A table shard which keeps its entries ordered by key.
+//
+// Entries are held in a sorted array, plus a small sorted buffer of
+// recently inserted keys.  Each key is in exactly one of the two.  Once the
+// buffer grows beyond roughly the square root of the table size, it is
+// merged into the main array.  Lookups are binary searches; iteration,
+// including over a key range [lo, hi), visits entries in key order.
+//
+// K must be ordered by operator<.
+template <class K, class V>
+class SortedTable :
+  public LocalTable,
+  public OrderedTable,
+  public TypedTable<K, V>,
+  private boost::noncopyable {
+private:
+  struct Entry {
+    K k;
+    V v;
+  };
+
+  typedef std::vector<Entry> Run;
+
+  struct KeyLess {
+    bool operator()(const Entry& a, const K& b) const { return a.k < b; }
+    bool operator()(const K& a, const Entry& b) const { return a < b.k; }
+    bool operator()(const Entry& a, const Entry& b) const { return a.k < b.k; }
+  };
+
+public:
+  // Visits the entries of both runs in key order, stopping at the first key
+  // not less than 'hi', if one is given.
+  struct Iterator : public TypedTableIterator<K, V> {
+    Iterator(SortedTable<K, V>& parent, int a, int b, const K* hi) :
+      parent_(parent), a_(a), b_(b), bounded_(hi != NULL) {
+      if (bounded_) { hi_ = *hi; }
+      pick();
+    }
+
+    void Next() {
+      if (in_main_) { ++a_; } else { ++b_; }
+      pick();
+    }
+
+    bool done() { return done_; }
+
+    const K& key() { return current().k; }
+    V& value() { return current().v; }
+
+    void key_str(string* k) {
+      return ((Marshal<K>*)parent_.info_->key_marshal)->marshal(key(), k);
+    }
+
+    void value_str(string *v) {
+      return ((Marshal<V>*)parent_.info_->value_marshal)->marshal(value(), v);
+    }
+
+  private:
+    Entry& current() { return in_main_ ? parent_.main_[a_] : parent_.delta_[b_]; }
+
+    void pick() {
+      bool main_left = a_ < parent_.main_.size();
+      bool delta_left = b_ < parent_.delta_.size();
+      in_main_ = main_left &&
+                 (!delta_left || parent_.main_[a_].k < parent_.delta_[b_].k);
+      done_ = !main_left && !delta_left;
+      if (!done_ && bounded_ && !(current().k < hi_)) {
+        done_ = true;
+      }
+    }
+
+    SortedTable<K, V> &parent_;
+    int a_, b_;
+    bool in_main_;
+    bool done_;
+    bool bounded_;
+    K hi_;
+  };
+
+  struct Factory : public TableFactory {
+    TableBase* New() { return new SortedTable<K, V>(); }
+  };
+
+  SortedTable() {}
+  ~SortedTable() {}
+
+  void Init(const TableDescriptor* td) {
+    TableBase::Init(td);
+  }
+
+  V get(const K& k);
+  bool contains(const K& k);
+  void put(const K& k, const V& v);
+  void update(const K& k, const V& v);
+  V* find(const K& k) {
+    Entry* e = find_entry(k);
+    return e ? &e->v : NULL;
+  }
+  V* find_or_insert(const K& k, bool *inserted);
+  void remove(const K& k) {
+    LOG(FATAL) << "Not implemented.";
+  }
+
+  void resize(int64_t size) { main_.reserve(size); }
+
+  bool empty() { return size() == 0; }
+  int64_t size() { return main_.size() + delta_.size(); }
+
+  void clear() {
+    main_.clear();
+    delta_.clear();
+  }
+
+  void swap(LocalTable *other) {
+    SortedTable<K, V> *t = dynamic_cast<SortedTable<K, V>*>(other);
+    CHECK(t != NULL) << "Swapping tables of different types.";
+    main_.swap(t->main_);
+    delta_.swap(t->delta_);
+  }
+
+  TableIterator *get_iterator() {
+    return new Iterator(*this, 0, 0, NULL);
+  }
+
+  // Iterate over the entries with keys in [lo, hi).
+  Iterator *get_range_iterator(const K& lo, const K& hi) {
+    int a = std::lower_bound(main_.begin(), main_.end(), lo, KeyLess()) - main_.begin();
+    int b = std::lower_bound(delta_.begin(), delta_.end(), lo, KeyLess()) - delta_.begin();
+    return new Iterator(*this, a, b, &hi);
+  }
+
+  TableIterator *get_range_iterator_str(const StringPiece& lo, const StringPiece& hi) {
+    K klo, khi;
+    ((Marshal<K>*)info_->key_marshal)->unmarshal(lo, &klo);
+    ((Marshal<K>*)info_->key_marshal)->unmarshal(hi, &khi);
+    return get_range_iterator(klo, khi);
+  }
+
+  void Serialize(TableCoder *out);
+  void ApplyUpdates(TableCoder *in);
+
+  bool contains_str(const StringPiece& s) {
+    K k;
+    ((Marshal<K>*)info_->key_marshal)->unmarshal(s, &k);
+    return contains(k);
+  }
+
+  string get_str(const StringPiece &s) {
+    K k;
+    ((Marshal<K>*)info_->key_marshal)->unmarshal(s, &k);
+    string out;
+    ((Marshal<V>*)info_->value_marshal)->marshal(get(k), &out);
+    return out;
+  }
+
+  void update_str(const StringPiece& kstr, const StringPiece &vstr) {
+    K k; V v;
+    ((Marshal<K>*)info_->key_marshal)->unmarshal(kstr, &k);
+    ((Marshal<V>*)info_->value_marshal)->unmarshal(vstr, &v);
+    update(k, v);
+  }
+
+private:
+  // Buffers smaller than this are never merged.
+  static const int kMinDeltaSize = 256;
+
+  // Return the entry for 'k', or NULL if there is none.
+  Entry* find_entry(const K& k) {
+    Entry* e = find_in(main_, k);
+    return e ? e : find_in(delta_, k);
+  }
+
+  static Entry* find_in(Run& r, const K& k) {
+    typename Run::iterator i = std::lower_bound(r.begin(), r.end(), k, KeyLess());
+    if (i == r.end() || k < i->k) {
+      return NULL;
+    }
+    return &*i;
+  }
+
+  void insert(const K& k, const V& v) {
+    Entry e;
+    e.k = k;
+    e.v = v;
+    delta_.insert(std::upper_bound(delta_.begin(), delta_.end(), e, KeyLess()), e);
+
+    int limit = (int)sqrt((double)main_.size());
+    if (delta_.size() > (limit < kMinDeltaSize ? kMinDeltaSize : limit)) {
+      merge(&delta_);
+    }
+  }
+
+  // Merge a sorted run of entries with distinct keys into the main run,
+  // combining entries for keys already present with the accumulator.
+  // 'in' is cleared.
+  void merge(Run* in);
+
+  Run main_;
+  Run delta_;
+};
+
+template <class K, class V>
+V SortedTable<K, V>::get(const K& k) {
+  Entry* e = find_entry(k);
+  CHECK(e != NULL) << "No entry for requested key: " << k;
+  return e->v;
+}
+
+template <class K, class V>
+bool SortedTable<K, V>::contains(const K& k) {
+  return find_entry(k) != NULL;
+}
+
+template <class K, class V>
+void SortedTable<K, V>::put(const K& k, const V& v) {
+  Entry* e = find_entry(k);
+  if (e) {
+    e->v = v;
+  } else {
+    insert(k, v);
+  }
+}
+
+template <class K, class V>
+void SortedTable<K, V>::update(const K& k, const V& v) {
+  Entry* e = find_entry(k);
+  if (e) {
+    ((Accumulator<V>*)info_->accum)->Accumulate(&e->v, v);
+  } else {
+    insert(k, v);
+  }
+}
+
+// Inserting may merge the buffer into the main run, moving entries, so a
+// new entry is looked up again.
+template <class K, class V>
+V* SortedTable<K, V>::find_or_insert(const K& k, bool *inserted) {
+  Entry* e = find_entry(k);
+  *inserted = (e == NULL);
+  if (e == NULL) {
+    insert(k, V());
+    e = find_entry(k);
+  }
+  return &e->v;
+}
+
+template <class K, class V>
+void SortedTable<K, V>::merge(Run* in) {
+  Accumulator<V>* accum = (Accumulator<V>*)info_->accum;
+
+  Run out;
+  out.reserve(main_.size() + in->size());
+
+  typename Run::iterator a = main_.begin(), b = in->begin();
+  while (a != main_.end() && b != in->end()) {
+    if (a->k < b->k) {
+      out.push_back(*a++);
+    } else if (b->k < a->k) {
+      out.push_back(*b++);
+    } else {
+      out.push_back(*a++);
+      accum->Accumulate(&out.back().v, (b++)->v);
+    }
+  }
+  out.insert(out.end(), a, main_.end());
+  out.insert(out.end(), b, in->end());
+
+  main_.swap(out);
+  in->clear();
+}
+
+template <class K, class V>
+void SortedTable<K, V>::Serialize(TableCoder *out) {
+  Iterator *i = (Iterator*)get_iterator();
+  string k, v;
+  while (!i->done()) {
+    k.clear(); v.clear();
+    ((Marshal<K>*)info_->key_marshal)->marshal(i->key(), &k);
+    ((Marshal<V>*)info_->value_marshal)->marshal(i->value(), &v);
+    out->WriteEntry(k, v);
+    i->Next();
+  }
+  delete i;
+}
+
+// Updates from other sorted tables arrive in key order; larger batches are
+// merged with the table in a single pass rather than inserted one by one.
+template <class K, class V>
+void SortedTable<K, V>::ApplyUpdates(TableCoder *in) {
+  Accumulator<V>* accum = (Accumulator<V>*)info_->accum;
+  Marshal<K>* km = (Marshal<K>*)info_->key_marshal;
+  Marshal<V>* vm = (Marshal<V>*)info_->value_marshal;
+
+  Run batch;
+  bool sorted = true;
+  Entry e;
+  string kt, vt;
+  while (in->ReadEntry(&kt, &vt)) {
+    km->unmarshal(kt, &e.k);
+    vm->unmarshal(vt, &e.v);
+    if (!batch.empty() && !(batch.back().k < e.k)) {
+      sorted = false;
+    }
+    batch.push_back(e);
+  }
+
+  if (batch.size() < kMinDeltaSize) {
+    for (int i = 0; i < batch.size(); ++i) {
+      update(batch[i].k, batch[i].v);
+    }
+    return;
+  }
+
+  if (!sorted) {
+    std::stable_sort(batch.begin(), batch.end(), KeyLess());
+
+    // Combine repeated keys so the run has distinct keys, as merge expects.
+    int last = 0;
+    for (int i = 1; i < batch.size(); ++i) {
+      if (batch[last].k < batch[i].k) {
+        batch[++last] = batch[i];
+      } else {
+        accum->Accumulate(&batch[last].v, batch[i].v);
+      }
+    }
+    batch.resize(last + 1);
+  }
+
+  merge(&delta_);
+  merge(&batch);
+}
+
+}
+
+#endif /* SORTED_TABLE_H_ */
@@ -11,6 +11,9 @@ namespace dsm {
 
 static const double kLoadFactor = 0.8;
 
+// Buckets are stamped with the generation of the table they were filled
+// in; a bucket is in use only if its stamp is the current generation, so
+// clearing the table just starts a new generation.
 template <class K, class V>
 class SparseTable :
   public LocalTable,
@@ -21,7 +24,7 @@ private:
   struct Bucket {
     K k;
     V v;
-    bool in_use;
+    uint16_t gen;
   };
 #pragma pack(pop)
 
@@ -32,7 +35,7 @@ public:
     void Next() {
       do {
         ++pos;
-      } while (pos < parent_.size_ && !parent_.buckets_[pos].in_use);
+      } while (pos < parent_.size_ && !parent_.in_use(pos));
     }
 
     bool done() {
@@ -70,6 +73,9 @@ public:
   bool contains(const K& k);
   void put(const K& k, const V& v);
   void update(const K& k, const V& v);
+  V* find(const K& k);
+  V* find_or_insert(const K& k, bool *inserted);
+  V* find_or_swap(const K& k, V *v, bool *inserted);
   void remove(const K& k) {
     LOG(FATAL) << "Not implemented.";
   }
@@ -80,10 +86,26 @@ public:
   int64_t size() { return entries_; }
 
   void clear() {
-    for (int i = 0; i < size_; ++i) { buckets_[i].in_use = 0; }
+    // Once the stamp wraps around, old buckets could look current again.
+    if (++gen_ == 0) {
+      for (int i = 0; i < size_; ++i) { buckets_[i].gen = 0; }
+      gen_ = 1;
+    }
     entries_ = 0;
   }
 
+  bool splittable() { return true; }
+
+  // Exchange contents, and capacity, with another SparseTable.
+  void swap(LocalTable *other) {
+    SparseTable<K, V> *t = dynamic_cast<SparseTable<K, V>*>(other);
+    CHECK(t != NULL) << "Swapping tables of different types.";
+    buckets_.swap(t->buckets_);
+    std::swap(entries_, t->entries_);
+    std::swap(size_, t->size_);
+    std::swap(gen_, t->gen_);
+  }
+
   TableIterator *get_iterator() {
       return new Iterator(*this);
   }
@@ -113,16 +135,22 @@ public:
   }
 
 private:
+  bool in_use(int b) const { return buckets_[b].gen == gen_; }
+
   uint32_t bucket_idx(K k) {
     return hashobj_(k) % size_;
   }
 
+  // The bucket for 'k', claiming a free one if there is none; the value of
+  // a newly claimed bucket is left as it was.
+  int claim_bucket(const K& k, bool *inserted);
+
   int bucket_for_key(const K& k) {
     int start = bucket_idx(k);
     int b = start;
 
     do {
-      if (buckets_[b].in_use) {
+      if (in_use(b)) {
         if (buckets_[b].k == k) {
           return b;
         }
@@ -140,14 +168,14 @@ private:
 
   int64_t entries_;
   int64_t size_;
+  uint16_t gen_;
 
   std::tr1::hash<K> hashobj_;
 };
 
 template <class K, class V>
 SparseTable<K, V>::SparseTable(int size)
-  : buckets_(0), entries_(0), size_(0) {
-  clear();
+  : buckets_(0), entries_(0), size_(0), gen_(1) {
 
   resize(size);
 }
@@ -183,17 +211,23 @@ void SparseTable<K, V>::resize(int64_t size) {
   if (size_ == size)
     return;
 
-  std::vector<Bucket> old_b = buckets_;
+  std::vector<Bucket> old_b;
+  old_b.swap(buckets_);
   int old_entries = entries_;
+  uint16_t old_gen = gen_;
 
 //  LOG(INFO) << "Rehashing... " << entries_ << " : " << size_ << " -> " << size;
 
-  buckets_.resize(size);
+  // New buckets start out unused: stamped with generation 0, which is never
+  // current.
+  buckets_.resize(size, Bucket());
   size_ = size;
-  clear();
+  gen_ = 1;
+  entries_ = 0;
 
-  for (int i = 0; i < old_b.size(); ++i) {
-    if (old_b[i].in_use) {
+  // Empty tables (e.g. freshly flushed write buffers) need no rehash.
+  for (int i = 0; old_entries > 0 && i < old_b.size(); ++i) {
+    if (old_b[i].gen == old_gen) {
       put(old_b[i].k, old_b[i].v);
     }
   }
@@ -215,50 +249,76 @@ V SparseTable<K, V>::get(const K& k) {
 }
 
 template <class K, class V>
-void SparseTable<K, V>::update(const K& k, const V& v) {
+V* SparseTable<K, V>::find(const K& k) {
   int b = bucket_for_key(k);
+  return b == -1 ? NULL : &buckets_[b].v;
+}
 
-  if (b != -1) {
-    ((Accumulator<V>*)info_->accum)->Accumulate(&buckets_[b].v, v);
+template <class K, class V>
+void SparseTable<K, V>::update(const K& k, const V& v) {
+  bool inserted;
+  V* p = &buckets_[claim_bucket(k, &inserted)].v;
+  if (inserted) {
+    *p = v;
   } else {
-    put(k, v);
+    ((Accumulator<V>*)info_->accum)->Accumulate(p, v);
   }
 }
 
 template <class K, class V>
 void SparseTable<K, V>::put(const K& k, const V& v) {
+  bool inserted;
+  buckets_[claim_bucket(k, &inserted)].v = v;
+}
+
+template <class K, class V>
+V* SparseTable<K, V>::find_or_insert(const K& k, bool *inserted) {
+  V* p = &buckets_[claim_bucket(k, inserted)].v;
+  if (*inserted) {
+    *p = V();
+  }
+  return p;
+}
+
+template <class K, class V>
+V* SparseTable<K, V>::find_or_swap(const K& k, V *v, bool *inserted) {
+  V* p = &buckets_[claim_bucket(k, inserted)].v;
+  if (*inserted) {
+    using std::swap;
+    swap(*p, *v);
+  }
+  return p;
+}
+
+template <class K, class V>
+int SparseTable<K, V>::claim_bucket(const K& k, bool *inserted) {
   int start = bucket_idx(k);
   int b = start;
-  bool found = false;
 
   do {
-    if (!buckets_[b].in_use) {
+    if (!in_use(b)) {
       break;
     }
 
     if (buckets_[b].k == k) {
-      found = true;
-      break;
+      *inserted = false;
+      return b;
     }
 
     b = (b + 1) % size_;
   } while(b != start);
 
   // Inserting a new entry:
-  if (!found) {
-    if (entries_ > size_ * kLoadFactor) {
-      resize((int)(1 + size_ * 2));
-      put(k, v);
-    } else {
-      buckets_[b].in_use = 1;
-      buckets_[b].k = k;
-      buckets_[b].v = v;
-      ++entries_;
-    }
-  } else {
-    // Replacing an existing entry
-    buckets_[b].v = v;
+  if (entries_ > size_ * kLoadFactor) {
+    resize((int)(1 + size_ * 2));
+    return claim_bucket(k, inserted);
   }
+
+  buckets_[b].gen = gen_;
+  buckets_[b].k = k;
+  ++entries_;
+  *inserted = true;
+  return b;
 }
 }
 #endif /* SPARSE_MAP_H_ */
@@ -7,6 +7,7 @@
 #include "local-table.h"
 #include "disk-table.h"
 #include "sparse-table.h"
+#include "sorted-table.h"
 #include "dense-table.h"
 
 namespace dsm {
@@ -69,6 +70,23 @@ static TypedGlobalTable<K, V>* CreateTable(int id,
   return CreateTable<K, V>(info);
 }
 
+// A table replicated to every worker; see TableDescriptor::replicated.
+template<class K, class V>
+static TypedGlobalTable<K, V>* CreateReplicatedTable(int id,
+                                                     int shards,
+                                                     Sharder<K>* sharding,
+                                                     Accumulator<V>* accum) {
+  TableDescriptor *info = new TableDescriptor(id, shards);
+  info->key_marshal = new Marshal<K>;
+  info->value_marshal = new Marshal<V>;
+  info->sharder = sharding;
+  info->partition_factory = new typename SparseTable<K, V>::Factory;
+  info->accum = accum;
+  info->replicated = true;
+
+  return CreateTable<K, V>(info);
+}
+
 template<class K, class V>
 static TypedGlobalTable<K, V>* CreateTable(const TableDescriptor *info) {
   TypedGlobalTable<K, V> *t = new TypedGlobalTable<K, V>();
@@ -77,5 +95,15 @@ static TypedGlobalTable<K, V>* CreateTable(const TableDescriptor *info) {
   return t;
 }
 
+// Create the two tables of a DoubleBufferedTable from one descriptor; the
+// next table gets id 'next_id'.
+template<class K, class V>
+static DoubleBufferedTable<K, V>* CreateDoubleBufferedTable(const TableDescriptor *info,
+                                                             int next_id) {
+  TableDescriptor *next = new TableDescriptor(*info);
+  next->table_id = next_id;
+  return new DoubleBufferedTable<K, V>(CreateTable<K, V>(info), CreateTable<K, V>(next));
+}
+
 } // end namespace
 #endif /* KERNEL_H_ */
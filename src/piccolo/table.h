@@ -4,7 +4,9 @@
 #include "piccolo/common.h"
 #include "piccolo/file.h"
 #include "piccolo/worker.pb.h"
+#include "piccolo/fixed-vector.h"
 #include <boost/thread.hpp>
+#include <algorithm>
 
 namespace dsm {
 
@@ -14,18 +16,93 @@ template <class V>
 struct Accumulators {
   struct Min : public Accumulator<V> {
     void Accumulate(V* a, const V& b) { *a = std::min(*a, b); }
+    void Accumulate(V* a, const V* b, int n) { min_arrays(a, b, n); }
   };
 
   struct Max : public Accumulator<V> {
     void Accumulate(V* a, const V& b) { *a = std::max(*a, b); }
+    void Accumulate(V* a, const V* b, int n) { max_arrays(a, b, n); }
   };
 
   struct Sum : public Accumulator<V> {
     void Accumulate(V* a, const V& b) { *a = *a + b; }
+    void Accumulate(V* a, const V* b, int n) { sum_arrays(a, b, n); }
   };
 
   struct Replace : public Accumulator<V> {
     void Accumulate(V* a, const V& b) { *a = b; }
+    void Accumulate(V* a, const V* b, int n) { std::copy(b, b + n, a); }
+  };
+};
+
+// Vectors are combined element-wise.  A run of vectors is plain data, so
+// batches are combined as one array of N * n elements.
+template <class T, int N>
+struct Accumulators<FixedVector<T, N> > {
+  typedef FixedVector<T, N> V;
+
+  struct Min : public Accumulator<V> {
+    void Accumulate(V* a, const V& b) { min_arrays(a->v, b.v, N); }
+    void Accumulate(V* a, const V* b, int n) { min_arrays(a->v, b->v, N * n); }
+  };
+
+  struct Max : public Accumulator<V> {
+    void Accumulate(V* a, const V& b) { max_arrays(a->v, b.v, N); }
+    void Accumulate(V* a, const V* b, int n) { max_arrays(a->v, b->v, N * n); }
+  };
+
+  struct Sum : public Accumulator<V> {
+    void Accumulate(V* a, const V& b) { sum_arrays(a->v, b.v, N); }
+    void Accumulate(V* a, const V* b, int n) { sum_arrays(a->v, b->v, N * n); }
+  };
+
+  struct Replace : public Accumulator<V> {
+    void Accumulate(V* a, const V& b) { *a = b; }
+    void Accumulate(V* a, const V* b, int n) { std::copy(b, b + n, a); }
+  };
+};
+
+// An empty vector takes the value of the first vector combined with it.
+template <class T>
+struct Accumulators<std::vector<T> > {
+  typedef std::vector<T> V;
+
+  static bool first(V* a, const V& b) {
+    if (a->empty()) {
+      *a = b;
+      return true;
+    }
+    CHECK_EQ(a->size(), b.size()) << "Combining vectors of different lengths.";
+    return b.empty();
+  }
+
+  struct Min : public Accumulator<V> {
+    void Accumulate(V* a, const V& b) { if (!first(a, b)) { min_arrays(&(*a)[0], &b[0], b.size()); } }
+  };
+
+  struct Max : public Accumulator<V> {
+    void Accumulate(V* a, const V& b) { if (!first(a, b)) { max_arrays(&(*a)[0], &b[0], b.size()); } }
+  };
+
+  struct Sum : public Accumulator<V> {
+    void Accumulate(V* a, const V& b) { if (!first(a, b)) { sum_arrays(&(*a)[0], &b[0], b.size()); } }
+  };
+
+  struct Replace : public Accumulator<V> {
+    void Accumulate(V* a, const V& b) { *a = b; }
+  };
+};
+
+// Commonly used priorities for numeric values.
+template <class K, class V>
+struct Priorities {
+  // Smallest values first, e.g. tentative distances.
+  struct Smallest : public Prioritizer<K, V> {
+    double operator()(const K& k, const V& v) { return v; }
+  };
+
+  struct Largest : public Prioritizer<K, V> {
+    double operator()(const K& k, const V& v) { return -v; }
   };
 };
 
@@ -41,6 +118,20 @@ struct Sharding {
   struct UintMod : public Sharder<uint32_t> {
     int operator()(const uint32_t& key, int shards) { return key % shards; }
   };
+
+  // Contiguous key ranges: shard i holds keys in [splits[i-1], splits[i]).
+  // Keys past the last split go to the last shard.
+  template <class K>
+  struct Range : public Sharder<K> {
+    Range(const vector<K>& splits) : splits_(splits) {}
+
+    int operator()(const K& key, int shards) {
+      int s = std::upper_bound(splits_.begin(), splits_.end(), key) - splits_.begin();
+      return s < shards ? s : shards - 1;
+    }
+
+    vector<K> splits_;
+  };
 };
 #endif
 
@@ -56,6 +147,16 @@ public:
     table_id = id;
     num_shards = shards;
     block_size = 500;
+
+    max_peer_pending_bytes = 1 << 22;
+    max_pending_bytes = 1 << 26;
+    max_flush_delay = 1.0;
+    shrink_after_flush = false;
+    replicated = false;
+    max_shards = 0;
+    track_changes = false;
+    priority = NULL;
+    delta_threshold = 0;
   }
 
   TableDescriptor(const TableDescriptor& t) {
@@ -78,9 +179,52 @@ public:
   // for dense tables
   int block_size;
   void *block_info;
+
+  // Limits on updates buffered for remote shards.  Buffered data is flushed
+  // once the bytes destined for a single peer or for all peers exceed the
+  // given sizes, or when it has been held for more than max_flush_delay
+  // seconds.
+  int64_t max_peer_pending_bytes;
+  int64_t max_pending_bytes;
+  double max_flush_delay;
+
+  // Shrink write buffers back to their initial size after each flush.
+  bool shrink_after_flush;
+
+  // Keep a read-only replica of every shard on each worker.  Replicas are
+  // refreshed from the shard owners at the end of each kernel; reads of
+  // remote shards are served from the replica, while updates are still sent
+  // to the owner.  Intended for small, read-mostly tables.
+  bool replicated;
+
+  // If non-zero, the master may split oversized or slow shards of this
+  // table, up to this many shards in total.  Keys are first assigned a shard
+  // by the sharder, as usual; keys of a shard that has been split are then
+  // divided among its pieces by hash.  Kernels on split tables must not
+  // assume which keys a shard holds, or that shard i of this table holds the
+  // same keys as shard i of another table.  Only tables with hash
+  // partitions (SparseTable) can be split.
+  int max_shards;
+
+  // Record the keys of local shards changed by updates, for iteration over
+  // just those keys (TypedGlobalTable::get_changed_iterator).
+  bool track_changes;
+
+  // A Prioritizer<K, V> ordering the changed keys of each shard, for
+  // TypedGlobalTable::get_priority_iterator.  Requires track_changes.
+  void *priority;
+
+  // Only for numeric tables accumulated by Sum: if positive, buffered
+  // updates for remote shards whose magnitude is below this threshold are
+  // held back when the buffer is flushed, and keep accumulating until they
+  // reach it.  Held updates count against the buffer limits above, and are
+  // sent if they alone exceed them, when the master asks for them
+  // (Master::flush_held_updates), and at the end of a worker-side loop.
+  double delta_threshold;
 };
 
 struct TableIterator {
+  virtual ~TableIterator() {}
   virtual void key_str(string *out) = 0;
   virtual void value_str(string *out) = 0;
   virtual bool done() = 0;
@@ -131,6 +275,13 @@ public:
 };
 
 
+// Tables which keep their entries in key order, and can iterate over the
+// entries with keys in [lo, hi).
+class OrderedTable {
+public:
+  virtual TableIterator* get_range_iterator_str(const StringPiece& lo, const StringPiece& hi) = 0;
+};
+
 template <class K, class V>
 struct TypedTableIterator : public TableIterator {
   virtual const K& key() = 0;
@@ -146,6 +297,26 @@ public:
   virtual void put(const K &k, const V &v) = 0;
   virtual void update(const K &k, const V &v) = 0;
   virtual void remove(const K &k) = 0;
+
+  // Return a pointer to the value for 'k', or NULL if there is none.  The
+  // pointer is valid until the table is next modified, by any thread.
+  virtual V* find(const K &k) = 0;
+
+  // As find, but insert a default value for 'k' if there is none, setting
+  // '*inserted' to say whether it did.
+  virtual V* find_or_insert(const K &k, bool *inserted) = 0;
+
+  // As find_or_insert, but a new entry takes the contents of '*v' by
+  // swapping, instead of a default value; '*v' is left with whatever the
+  // new slot held.  Tables override this to skip building the default.
+  virtual V* find_or_swap(const K &k, V *v, bool *inserted) {
+    V* p = find_or_insert(k, inserted);
+    if (*inserted) {
+      using std::swap;
+      swap(*p, *v);
+    }
+    return p;
+  }
 };
 
 class TableData;
@@ -1,15 +1,30 @@
 #include <boost/bind.hpp>
 #include <signal.h>
+#include <unistd.h>
 
 #include "piccolo/common.h"
 #include "piccolo/worker.h"
 #include "piccolo/kernel.h"
+#include "piccolo/aggregator.h"
 #include "table-registry.h"
 
 DEFINE_double(sleep_hack, 0.0, "");
 DEFINE_double(sleep_time, 0.001, "");
 DEFINE_string(checkpoint_write_dir, "/scratch/power/checkpoints", "");
 DEFINE_string(checkpoint_read_dir, "/scratch/power/checkpoints", "");
+DEFINE_int32(get_threads, 0,
+             "Number of threads serving get and iterator requests from other "
+             "workers.  If 0, requests are served from the network thread.");
+DEFINE_bool(aggregate_host_updates, false,
+            "Combine updates from all workers on a host for workers on other "
+            "hosts at one worker per host, before sending them across the network.");
+DEFINE_int32(control_fanout, 8,
+             "Fanout of the tree over which the master and workers pass "
+             "barrier messages.  Rank r forwards to ranks r*fanout+1 through "
+             "r*fanout+fanout.");
+DEFINE_bool(apply_thread, false,
+            "Apply updates from other workers in a dedicated thread, rather "
+            "than periodically from the kernel.");
 
 namespace dsm {
 
@@ -38,26 +53,97 @@ Worker::Worker(const ConfigData &c) {
   running_ = true;
   iterator_id_ = 0;
 
+  active_table_ = active_shard_ = -1;
+  puts_received_ = 0;
+  puts_received_from_.resize(num_peers_, 0);
+  speculative_task_ = make_pair(-1, -1);
+  apply_time_ = 0;
+  apply_thread_ = NULL;
+  if (FLAGS_apply_thread) {
+    apply_thread_ = new boost::thread(boost::bind(&Worker::ApplyLoop, this));
+    NetworkThread::Get()->RegisterCallback(MTYPE_PUT_REQUEST,
+                                           boost::bind(&Worker::SignalApplyThread, this));
+  }
+
+  if (FLAGS_get_threads > 0) {
+    for (int i = 0; i < FLAGS_get_threads; ++i) {
+      server_threads_.push_back(new boost::thread(boost::bind(&Worker::ServerLoop, this)));
+    }
+
+    NetworkThread::Get()->RegisterCallback(MTYPE_GET_REQUEST,
+                                           boost::bind(&Worker::SignalServerThreads, this));
+    NetworkThread::Get()->RegisterCallback(MTYPE_ITERATOR_REQ,
+                                           boost::bind(&Worker::SignalServerThreads, this));
+  } else {
+    NetworkThread::Get()->RegisterCallback(MTYPE_GET_REQUEST,
+                                           boost::bind(&Worker::HandleGetRequests, this));
+    NetworkThread::Get()->RegisterCallback(MTYPE_ITERATOR_REQ,
+                                           boost::bind(&Worker::HandleIteratorRequests, this));
+  }
+
   // HACKHACKHACK - register ourselves with any existing tables
   TableRegistry::Map &t = TableRegistry::Get()->tables();
   for (TableRegistry::Map::iterator i = t.begin(); i != t.end(); ++i) {
     i->second->set_worker(this);
   }
 
-  NetworkThread::Get()->RegisterCallback(MTYPE_GET_REQUEST,
-                                         boost::bind(&Worker::HandleGetRequests, this));
   NetworkThread::Get()->RegisterCallback(MTYPE_SHARD_ASSIGNMENT,
                                          boost::bind(&Worker::HandleShardAssignment, this));
-  NetworkThread::Get()->RegisterCallback(MTYPE_ITERATOR_REQ,
-                                         boost::bind(&Worker::HandleIteratorRequests, this));
+  NetworkThread::Get()->RegisterCallback(MTYPE_TASK_COMMIT,
+                                         boost::bind(&Worker::HandleTaskCommit, this));
 }
 
 int Worker::peer_for_shard(int table, int shard) const {
   return TableRegistry::Get()->tables()[table]->owner(shard);
 }
 
+int Worker::update_target(int peer) const {
+  if (aggregators_.empty()) {
+    return peer;
+  }
+
+  // Updates for peers on this host, and updates we have already combined
+  // as the host aggregator, go directly to the peer.
+  int local = aggregators_[id()];
+  if (local == aggregators_[peer] || local == id()) {
+    return peer;
+  }
+
+  return local;
+}
+
 void Worker::Run() {
   KernelLoop();
+
+  if (apply_thread_) {
+    SignalApplyThread();
+    apply_thread_->join();
+    stats_["apply_time"] += apply_time_;
+  }
+
+  SignalServerThreads();
+  for (int i = 0; i < server_threads_.size(); ++i) {
+    server_threads_[i]->join();
+  }
+
+  // Time spent holding shard locks; compare against apply_time and the
+  // request service times to judge lock contention.
+  const double freq = get_processor_frequency();
+  TableRegistry::Map &t = TableRegistry::Get()->tables();
+  for (TableRegistry::Map::iterator i = t.begin(); i != t.end(); ++i) {
+    stats_["apply_lock_hold_time"] += i->second->apply_lock_cycles_ / freq;
+    stats_["read_lock_hold_time"] += i->second->read_lock_cycles_ / freq;
+    stats_["migration_bytes"] += i->second->migration_bytes_;
+    stats_["migration_time"] += i->second->migration_micros_ * 1e-6;
+    stats_["updates_sent"] += i->second->updates_sent_;
+    stats_["updates_held"] += i->second->updates_held_;
+  }
+
+  boost::mutex::scoped_lock sl(server_lock_);
+  if (get_service_time_.getCount() > 0) {
+    stats_["get_requests"] += get_service_time_.getCount();
+    VLOG(1) << "Get request service time: \n" << get_service_time_.summary();
+  }
 }
 
 Worker::~Worker() {
@@ -72,6 +158,13 @@ void Worker::KernelLoop() {
   VLOG(1) << "Worker " << config_.worker_id() << " registering...";
   RegisterWorkerRequest req;
   req.set_id(id());
+
+  char hostname[1024];
+  if (gethostname(hostname, sizeof(hostname)) == 0) {
+    hostname[sizeof(hostname) - 1] = '\0';
+    req.set_hostname(hostname);
+  }
+
   network_->Send(0, MTYPE_REGISTER_WORKER, req);
 
 
@@ -80,7 +173,7 @@ void Worker::KernelLoop() {
   while (running_) {
     Timer idle;
 
-    while (!network_->TryRead(config_.master_id(), MTYPE_RUN_KERNEL, &kreq)) {
+    while (!NextKernelRequest(&kreq)) {
       CheckNetwork();
       Sleep(FLAGS_sleep_time);
 
@@ -92,21 +185,18 @@ void Worker::KernelLoop() {
 
     VLOG(1) << "Received run request for " << kreq;
 
-    if (peer_for_shard(kreq.table(), kreq.shard()) != config_.worker_id()) {
+    if (kreq.max_rounds() > 0) {
+      RunLoop(kreq);
+      continue;
+    }
+
+    if (!kreq.backup() && peer_for_shard(kreq.table(), kreq.shard()) != config_.worker_id()) {
       LOG(FATAL) << "Received a shard I can't work on! : " << kreq.shard()
                  << " : " << peer_for_shard(kreq.table(), kreq.shard());
     }
 
     KernelInfo *helper = KernelRegistry::Get()->kernel(kreq.kernel());
-    KernelId id(kreq.kernel(), kreq.table(), kreq.shard());
-    DSMKernel* d = kernels_[id];
-
-    if (!d) {
-      d = helper->create();
-      kernels_[id] = d;
-      d->initialize_internal(this, kreq.table(), kreq.shard());
-      d->InitKernel();
-    }
+    DSMKernel* d = GetKernel(kreq.kernel(), kreq.table(), kreq.shard());
 
     MarshalledMap args;
     args.FromMessage(kreq.args());
@@ -116,37 +206,332 @@ void Worker::KernelLoop() {
       Sleep(FLAGS_sleep_hack);
     }
 
-    // Run the user kernel
-    helper->Run(d, kreq.method());
+    {
+      boost::recursive_mutex::scoped_lock sl(state_lock_);
+      active_table_ = kreq.table();
+      active_shard_ = kreq.shard();
+    }
+
+    GlobalTable *locality = TableRegistry::Get()->table(kreq.table());
+    if (kreq.speculative()) {
+      BeginSpeculation(kreq);
+      if (kreq.backup()) {
+        Timer snapshot;
+        locality->FetchSnapshot(kreq.shard());
+        stats_["snapshot_time"] += snapshot.elapsed();
+      }
+    }
+
+    if (kreq.wait_puts_size() > 0) {
+      WaitForPuts(kreq);
+    }
+
+    // Run the user kernel, unless it is a speculative copy that has already
+    // lost to another.
+    Timer run;
+    if (!kreq.speculative() || !locality->cancelled_) {
+      helper->Run(d, kreq.method());
+    }
+    double runtime = run.elapsed();
+
+    {
+      boost::recursive_mutex::scoped_lock sl(state_lock_);
+      active_table_ = active_shard_ = -1;
+    }
+
+    if (apply_thread_) {
+      HandlePutRequests();
+    }
 
     KernelDone kd;
     kd.mutable_kernel()->CopyFrom(kreq);
-    TableRegistry::Map &tmap = TableRegistry::Get()->tables();
-    for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
-      GlobalTable* t = i->second;
-      for (int j = 0; j < t->num_shards(); ++j) {
-        if (t->is_local_shard(j)) {
-          ShardInfo *si = kd.add_shards();
-          si->set_entries(t->shard_size(j));
-          si->set_owner(this->id());
-          si->set_table(i->first);
-          si->set_shard(j);
-        }
+    kd.set_runtime(runtime);
+    AddShardInfo(&kd);
+
+    // Tasks which depend on a graph task learn from the master how many
+    // updates to wait for.
+    if (kreq.graph_task() >= 0) {
+      Flush();
+      for (int j = 0; j < num_peers_; ++j) {
+        kd.add_puts_sent(network_->sent_count(j + 1, MTYPE_PUT_REQUEST));
       }
     }
     network_->Send(config_.master_id(), MTYPE_KERNEL_DONE, kd);
 
+    if (kreq.speculative()) {
+      bool commit = EndSpeculation(kreq);
+      if (kreq.backup()) {
+        locality->DropSnapshot(kreq.shard());
+      }
+      stats_[commit ? "speculative_commits" : "speculative_aborts"] += 1;
+    }
+
     VLOG(1) << "Kernel finished: " << kreq;
     DumpProfile();
   }
 }
 
-void Worker::Flush() {
+void Worker::QueueKernelRequests() {
+  boost::recursive_mutex::scoped_lock sl(state_lock_);
+  KernelRequest kreq;
+  while (network_->TryRead(config_.master_id(), MTYPE_RUN_KERNEL, &kreq)) {
+    queued_kernels_.push_back(kreq);
+  }
+}
+
+bool Worker::NextKernelRequest(KernelRequest* kreq) {
+  boost::recursive_mutex::scoped_lock sl(state_lock_);
+  QueueKernelRequests();
+  if (queued_kernels_.empty()) {
+    return false;
+  }
+
+  kreq->CopyFrom(queued_kernels_.front());
+  queued_kernels_.pop_front();
+  return true;
+}
+
+DSMKernel* Worker::GetKernel(const string& kernel, int table, int shard) {
+  KernelId id(kernel, table, shard);
+  DSMKernel* d = kernels_[id];
+
+  if (!d) {
+    d = KernelRegistry::Get()->kernel(kernel)->create();
+    kernels_[id] = d;
+    d->initialize_internal(this, table, shard);
+    d->InitKernel();
+  }
+  return d;
+}
+
+void Worker::AddShardInfo(KernelDone* kd) {
+  TableRegistry::Map &tmap = TableRegistry::Get()->tables();
+  for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
+    GlobalTable* t = i->second;
+    for (int j = 0; j < t->num_shards(); ++j) {
+      if (t->is_local_shard(j)) {
+        ShardInfo *si = kd->add_shards();
+        si->set_entries(t->shard_size(j));
+        si->set_owner(this->id());
+        si->set_table(i->first);
+        si->set_shard(j);
+      }
+    }
+  }
+}
+
+// After each round, the workers sum the deltas reported by their kernels
+// and the number of updates each has sent to every other.  Once every update
+// sent to us has been applied, the next round starts, unless the deltas
+// have fallen below the threshold.
+void Worker::RunLoop(const KernelRequest& kreq) {
+  KernelInfo *helper = KernelRegistry::Get()->kernel(kreq.kernel());
+  MarshalledMap args;
+  args.FromMessage(kreq.args());
+
+  Timer run;
+  int round = 0;
+  double delta = 0;
+  while (round < kreq.max_rounds()) {
+    args.put<int>("round", round);
+
+    delta = 0;
+    for (int i = 0; i < kreq.loop_shards_size(); ++i) {
+      DSMKernel* d = GetKernel(kreq.kernel(), kreq.table(), kreq.loop_shards(i));
+      d->set_args(args);
+      d->delta_ = 0;
+
+      {
+        boost::recursive_mutex::scoped_lock sl(state_lock_);
+        active_table_ = kreq.table();
+        active_shard_ = kreq.loop_shards(i);
+      }
+
+      helper->Run(d, kreq.method());
+
+      {
+        boost::recursive_mutex::scoped_lock sl(state_lock_);
+        active_table_ = active_shard_ = -1;
+      }
+      delta += d->delta_;
+    }
+    ++round;
+
+    delta = SyncRound(delta, false);
+
+    VLOG(1) << "Finished round " << round << " of " << kreq.method() << "; delta " << delta;
+    if (delta < kreq.converged()) {
+      break;
+    }
+  }
+
+  // Deliver the updates held back by delta thresholds before finishing.
+  TableRegistry::Map &tmap = TableRegistry::Get()->tables();
+  for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
+    if (i->second->info().delta_threshold > 0) {
+      SyncRound(0, true);
+      break;
+    }
+  }
+
+  KernelDone kd;
+  kd.mutable_kernel()->CopyFrom(kreq);
+  kd.set_runtime(run.elapsed());
+  kd.set_rounds(round);
+  kd.set_delta(delta);
+  AddShardInfo(&kd);
+  network_->Send(config_.master_id(), MTYPE_KERNEL_DONE, kd);
+}
+
+double Worker::SyncRound(double delta, bool send_held) {
+  Flush(send_held);
+
+  Timer sync;
+  vector<double> values(1, delta);
+  vector<int64_t> counts(num_peers_);
+  for (int j = 0; j < num_peers_; ++j) {
+    counts[j] = network_->sent_count(j + 1, MTYPE_PUT_REQUEST);
+  }
+  AllReduce(&values, &counts);
+
+  while (true) {
+    HandlePutRequests();
+    {
+      boost::recursive_mutex::scoped_lock sl(state_lock_);
+      if (puts_received_ >= counts[id()]) {
+        break;
+      }
+    }
+    Sleep(FLAGS_sleep_time);
+  }
+  stats_["loop_sync_time"] += sync.elapsed();
+  return values[0];
+}
+
+void Worker::AllReduce(vector<double>* values, vector<int64_t>* counts) {
+  int f = FLAGS_control_fanout;
+  vector<int> children;
+  for (int i = f * id() + 1; i <= f * id() + f && i < num_peers_; ++i) {
+    children.push_back(i + 1);
+  }
+
+  ReduceData msg;
+  for (int i = 0; i < children.size(); ++i) {
+    ReadFromPeer(children[i], MTYPE_ALL_REDUCE, &msg);
+    for (int j = 0; j < values->size(); ++j) {
+      (*values)[j] += msg.values(j);
+    }
+    for (int j = 0; j < counts->size(); ++j) {
+      (*counts)[j] += msg.counts(j);
+    }
+  }
+
+  msg.Clear();
+  for (int j = 0; j < values->size(); ++j) {
+    msg.add_values((*values)[j]);
+  }
+  for (int j = 0; j < counts->size(); ++j) {
+    msg.add_counts((*counts)[j]);
+  }
+
+  // Pass our subtree's sums to our parent, and wait for the totals.
+  if (id() > 0) {
+    int parent = (id() - 1) / f + 1;
+    network_->Send(parent, MTYPE_ALL_REDUCE, msg);
+    ReadFromPeer(parent, MTYPE_ALL_REDUCE_RESULT, &msg);
+    for (int j = 0; j < values->size(); ++j) {
+      (*values)[j] = msg.values(j);
+    }
+    for (int j = 0; j < counts->size(); ++j) {
+      (*counts)[j] = msg.counts(j);
+    }
+  }
+
+  for (int i = 0; i < children.size(); ++i) {
+    network_->Send(children[i], MTYPE_ALL_REDUCE_RESULT, msg);
+  }
+}
+
+void Worker::BeginSpeculation(const KernelRequest& kreq) {
+  boost::recursive_mutex::scoped_lock sl(state_lock_);
+  speculative_task_ = make_pair(kreq.table(), kreq.shard());
+
+  TableRegistry::Map &tmap = TableRegistry::Get()->tables();
+  for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
+    i->second->BeginSpeculation();
+  }
+
+  AggregatorRegistry::Map &aggs = AggregatorRegistry::Get()->aggregators();
+  for (AggregatorRegistry::Map::iterator i = aggs.begin(); i != aggs.end(); ++i) {
+    i->second->BeginSpeculation();
+  }
+
+  // The master may have given the task to another copy already.
+  VerdictMap::iterator v = verdicts_.find(speculative_task_);
+  if (v != verdicts_.end() && !v->second) {
+    CancelSpeculation();
+  }
+}
+
+// Wait for the master to decide whether our copy of the kernel won, then
+// keep or discard its updates.
+bool Worker::EndSpeculation(const KernelRequest& kreq) {
+  pair<int, int> task(kreq.table(), kreq.shard());
+  bool commit;
+  while (true) {
+    {
+      boost::recursive_mutex::scoped_lock sl(state_lock_);
+      VerdictMap::iterator v = verdicts_.find(task);
+      if (v != verdicts_.end()) {
+        commit = v->second;
+        verdicts_.erase(v);
+        speculative_task_ = make_pair(-1, -1);
+        break;
+      }
+    }
+    HandlePutRequests();
+    Sleep(FLAGS_sleep_time);
+  }
+
+  TableRegistry::Map &tmap = TableRegistry::Get()->tables();
+  for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
+    i->second->EndSpeculation(commit);
+  }
+
+  AggregatorRegistry::Map &aggs = AggregatorRegistry::Get()->aggregators();
+  for (AggregatorRegistry::Map::iterator i = aggs.begin(); i != aggs.end(); ++i) {
+    i->second->EndSpeculation(commit);
+  }
+  return commit;
+}
+
+void Worker::CancelSpeculation() {
+  TableRegistry::Map &tmap = TableRegistry::Get()->tables();
+  for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
+    i->second->CancelSpeculation();
+  }
+}
+
+// Called from the network thread.  An abort for the running kernel also
+// cancels it, so that it finishes early.
+void Worker::HandleTaskCommit() {
+  boost::recursive_mutex::scoped_lock sl(state_lock_);
+  TaskCommit msg;
+  while (network_->TryRead(config_.master_id(), MTYPE_TASK_COMMIT, &msg)) {
+    pair<int, int> task(msg.table(), msg.shard());
+    verdicts_[task] = msg.commit();
+    if (!msg.commit() && task == speculative_task_) {
+      CancelSpeculation();
+    }
+  }
+}
+
+void Worker::Flush(bool send_held) {
   Timer net;
 
   TableRegistry::Map &tmap = TableRegistry::Get()->tables();
   for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
-    i->second->SendUpdates();
+    i->second->SendUpdates(send_held);
   }
 
   network_->Flush();
@@ -297,31 +682,100 @@ void Worker::Restore(int epoch) {
 void Worker::HandlePutRequests() {
   boost::recursive_mutex::scoped_lock sl(state_lock_);
 
+  // Updates held back by the apply thread can be applied safely here, as
+  // the kernel is not in the middle of accessing its shard.
+  for (int i = 0; i < deferred_puts_.size(); ++i) {
+    ApplyPut(*deferred_puts_[i]);
+    delete deferred_puts_[i];
+  }
+  deferred_puts_.clear();
+
+  DrainPutRequests(false);
+  CheckFlushDelays();
+}
+
+void Worker::CheckFlushDelays() {
+  TableRegistry::Map &tmap = TableRegistry::Get()->tables();
+  for (TableRegistry::Map::iterator i = tmap.begin(); i != tmap.end(); ++i) {
+    i->second->CheckFlushDelay();
+  }
+}
+
+void Worker::DrainPutRequests(bool defer_active) {
+  boost::recursive_mutex::scoped_lock sl(state_lock_);
+
   TableData put;
   while (network_->TryRead(MPI::ANY_SOURCE, MTYPE_PUT_REQUEST, &put)) {
     if (put.marker() != -1) {
+      ++puts_received_;
+      ++puts_received_from_[put.source()];
       UpdateEpoch(put.source(), put.marker());
       continue;
     }
 
-    VLOG(2) << "Read put request of size: "
-            << put.kv_data_size() << " for " << MP(put.table(), put.shard());
+    if (defer_active && put.table() == active_table_ && put.shard() == active_shard_) {
+      deferred_puts_.push_back(new TableData(put));
+      continue;
+    }
 
-    GlobalTable *t = TableRegistry::Get()->table(put.table());
-    t->ApplyUpdates(put);
+    ApplyPut(put);
+  }
+}
 
-    // Record messages from our peer channel up until they checkpointed.
-    if (active_checkpoint_ == CP_MASTER_CONTROLLED ||
-        (active_checkpoint_ == CP_ROLLING && put.epoch() < epoch_)) {
-      if (checkpoint_tables_.find(t->id()) != checkpoint_tables_.end()) {
-        t->write_delta(put);
-      }
+void Worker::ApplyPut(const TableData& put) {
+  VLOG(2) << "Read put request of size: "
+          << put.kv_data_size() << " for " << MP(put.table(), put.shard());
+
+  GlobalTable *t = TableRegistry::Get()->table(put.table());
+  t->ApplyUpdates(put);
+
+  // Puts are counted once applied, not when deferred by the apply thread,
+  // so that waiting for a count means waiting for the updates themselves.
+  ++puts_received_;
+  ++puts_received_from_[put.source()];
+
+  // Record messages from our peer channel up until they checkpointed.
+  if (active_checkpoint_ == CP_MASTER_CONTROLLED ||
+      (active_checkpoint_ == CP_ROLLING && put.epoch() < epoch_)) {
+    if (checkpoint_tables_.find(t->id()) != checkpoint_tables_.end()) {
+      t->write_delta(put);
+    }
+  }
+
+}
+
+void Worker::SignalApplyThread() {
+  boost::mutex::scoped_lock sl(apply_lock_);
+  apply_cond_.notify_one();
+}
+
+void Worker::ApplyLoop() {
+  while (running_) {
+    {
+      boost::mutex::scoped_lock sl(apply_lock_);
+      apply_cond_.timed_wait(sl, boost::posix_time::milliseconds(10));
     }
 
-    if (put.done() && t->tainted(put.shard())) {
-      VLOG(1) << "Clearing taint on: " << MP(put.table(), put.shard());
-      t->get_partition_info(put.shard())->tainted = false;
+    Timer t;
+    DrainPutRequests(true);
+    apply_time_ += t.elapsed();
+  }
+}
+
+void Worker::SignalServerThreads() {
+  boost::mutex::scoped_lock sl(server_lock_);
+  server_cond_.notify_all();
+}
+
+void Worker::ServerLoop() {
+  while (running_) {
+    {
+      boost::mutex::scoped_lock sl(server_lock_);
+      server_cond_.timed_wait(sl, boost::posix_time::milliseconds(10));
     }
+
+    HandleGetRequests();
+    HandleIteratorRequests();
   }
 }
 
@@ -329,6 +783,7 @@ void Worker::HandleGetRequests() {
   int source;
   HashGet get_req;
   while (network_->TryRead(MPI::ANY_SOURCE, MTYPE_GET_REQUEST, &get_req, &source)) {
+    Timer t;
     TableData get_resp;
 //    LOG(INFO) << "Get request: " << get_req;
 
@@ -346,6 +801,9 @@ void Worker::HandleGetRequests() {
 
     network_->Send(source, MTYPE_GET_RESPONSE, get_resp);
     VLOG(2) << "Returning result for " << MP(get_req.table(), get_req.shard()) << " - found? " << !get_resp.missing_key();
+
+    boost::mutex::scoped_lock sl(server_lock_);
+    get_service_time_.add(t.elapsed());
   }
 }
 
@@ -358,23 +816,43 @@ void Worker::HandleIteratorRequests() {
     int shard = iterator_req.shard();
 
     GlobalTable * t = TableRegistry::Get()->table(table);
+    boost::shared_lock<RWSpinLock> shard_sl(t->shard_lock(shard));
+
+    // Server-side iterators are left positioned at the first entry not yet
+    // sent.
     TableIterator* it = NULL;
+    uint32_t id;
     if (iterator_req.id() == -1) {
-      it = t->get_iterator(shard);
-      uint32_t id = iterator_id_++;
+      if (iterator_req.has_lo()) {
+        OrderedTable *o = dynamic_cast<OrderedTable*>(t->get_partition(shard));
+        CHECK(o != NULL) << "Range iteration requires an ordered table: " << MP(table, shard);
+        it = o->get_range_iterator_str(iterator_req.lo(), iterator_req.hi());
+      } else {
+        it = t->get_iterator(shard);
+      }
+      boost::mutex::scoped_lock sl(iterator_lock_);
+      id = iterator_id_++;
       iterators_[id] = it;
-      iterator_resp.set_id(id);
     } else {
-      it = iterators_[iterator_req.id()];
-      iterator_resp.set_id(iterator_req.id());
-      CHECK_NE(it, (void *)NULL);
+      boost::mutex::scoped_lock sl(iterator_lock_);
+      id = iterator_req.id();
+      it = iterators_[id];
+    }
+    CHECK_NE(it, (void *)NULL);
+    iterator_resp.set_id(id);
+
+    for (int i = 0; i < iterator_req.batch_size() && !it->done(); ++i) {
+      Arg *a = iterator_resp.add_entries();
+      it->key_str(a->mutable_key());
+      it->value_str(a->mutable_value());
       it->Next();
     }
 
     iterator_resp.set_done(it->done());
-    if (!it->done()) {
-      it->key_str(iterator_resp.mutable_key());
-      it->value_str(iterator_resp.mutable_value());
+    if (it->done()) {
+      boost::mutex::scoped_lock sl(iterator_lock_);
+      iterators_.erase(id);
+      delete it;
     }
 
     network_->Send(source, MTYPE_ITERATOR_RESP, iterator_resp);
@@ -388,6 +866,12 @@ void Worker::HandleShardAssignment() {
       const ShardAssignment &a = shard_req.assign(i);
       GlobalTable *t = TableRegistry::Get()->table(a.table());
       int old_owner = t->owner(a.shard());
+
+      // Reads of a replicated shard we give up go to our replica of it, so
+      // fill that before the shard stops being local.
+      if (t->replicated() && old_owner == id() && a.new_worker() != id()) {
+        t->KeepReplica(a.shard());
+      }
       t->get_partition_info(a.shard())->owner = a.new_worker();
 
       VLOG(3) << "Setting owner: " << MP(a.shard(), a.new_worker());
@@ -401,7 +885,7 @@ void Worker::HandleShardAssignment() {
           LOG(INFO) << "Setting " << MP(a.table(), a.shard())
                    << " as tainted.  Old owner was: " << old_owner
                    << " new owner is :  " << id();
-          t->get_partition_info(a.shard())->tainted = true;
+          t->StartMigration(a.shard());
         }
       } else if (old_owner == id() && a.new_worker() != id()) {
         VLOG(1) << "Lost ownership of " << MP(a.table(), a.shard()) << " to " << a.new_worker();
@@ -442,21 +926,207 @@ void Worker::CheckForMasterUpdates() {
     FinishCheckpoint();
   }
 
+  HostAggregators aggregators_msg;
+  while (network_->TryRead(config_.master_id(), MTYPE_HOST_AGGREGATORS, &aggregators_msg)) {
+    aggregators_.assign(aggregators_msg.aggregator().begin(), aggregators_msg.aggregator().end());
+    network_->Send(config_.master_id(), MTYPE_HOST_AGGREGATORS_DONE, empty);
+  }
+
+  ShardSplitRequest split_msg;
+  while (network_->TryRead(config_.master_id(), MTYPE_SHARD_SPLIT, &split_msg)) {
+    for (int i = 0; i < split_msg.split_size(); ++i) {
+      const ShardSplit &s = split_msg.split(i);
+      int child = TableRegistry::Get()->table(s.table())->split_shard(s.shard());
+      CHECK_EQ(child, s.child()) << "Shard splits out of order for table " << s.table();
+    }
+    network_->Send(config_.master_id(), MTYPE_SHARD_SPLIT_DONE, empty);
+  }
+
+  SwapTablesRequest swap_msg;
+  while (network_->TryRead(config_.master_id(), MTYPE_SWAP_TABLES, &swap_msg)) {
+    TableRegistry::Get()->table(swap_msg.current())->swap_local(
+        TableRegistry::Get()->table(swap_msg.next()));
+    network_->Send(config_.master_id(), MTYPE_SWAP_TABLES_DONE, empty);
+  }
+
+  // Requests for kernels we have not yet started can be withdrawn by the
+  // master, to give them to another worker.
+  QueueKernelRequests();
+  KernelCancel cancel_msg;
+  while (network_->TryRead(config_.master_id(), MTYPE_CANCEL_KERNEL, &cancel_msg)) {
+    cancel_msg.set_cancelled(false);
+    for (std::deque<KernelRequest>::iterator i = queued_kernels_.begin();
+         i != queued_kernels_.end(); ++i) {
+      if (i->table() == cancel_msg.table() && i->shard() == cancel_msg.shard()) {
+        queued_kernels_.erase(i);
+        cancel_msg.set_cancelled(true);
+        break;
+      }
+    }
+    network_->Send(config_.master_id(), MTYPE_CANCEL_KERNEL_DONE, cancel_msg);
+  }
+
   StartRestore restore_msg;
   while (network_->TryRead(config_.master_id(), MTYPE_RESTORE, &restore_msg)) {
     Restore(restore_msg.epoch());
   }
 
+  // The barrier rounds below wait on other workers; don't hold up the
+  // network thread's callbacks meanwhile.
+  sl.unlock();
+
   // Flush all pending updates if the master requests it.
-  while (network_->TryRead(config_.master_id(), MTYPE_WORKER_FLUSH, &empty)) {
-    Flush();
-    network_->Send(config_.master_id(), MTYPE_WORKER_FLUSH_DONE, empty);
+  FlushRequest flush_msg;
+  while (network_->TryRead(ParentRank(), MTYPE_WORKER_FLUSH, &flush_msg)) {
+    HandleFlush(flush_msg);
+  }
+
+  ApplyRequest apply_msg;
+  while (network_->TryRead(ParentRank(), MTYPE_WORKER_APPLY, &apply_msg)) {
+    HandleApply(apply_msg);
+  }
+
+  while (network_->TryRead(config_.master_id(), MTYPE_WORKER_REPLICATE, &empty)) {
+    UpdateReplicas();
+    network_->Send(config_.master_id(), MTYPE_WORKER_REPLICATE_DONE, empty);
+  }
+}
+
+int Worker::ParentRank() const {
+  return id() / FLAGS_control_fanout;
+}
+
+vector<int> Worker::ChildRanks() const {
+  vector<int> out;
+  int first = (id() + 1) * FLAGS_control_fanout + 1;
+  for (int r = first; r < first + FLAGS_control_fanout && r < network_->size(); ++r) {
+    out.push_back(r);
+  }
+  return out;
+}
+
+void Worker::ReadFromPeer(int rank, int type, Message* msg) {
+  while (!network_->TryRead(rank, type, msg)) {
+    HandlePutRequests();
+    Sleep(FLAGS_sleep_time);
+  }
+}
+
+void Worker::WaitForPuts(const KernelRequest& kreq) {
+  Timer t;
+  for (int j = 0; j < kreq.wait_puts_size(); ++j) {
+    while (true) {
+      HandlePutRequests();
+      {
+        boost::recursive_mutex::scoped_lock sl(state_lock_);
+        if (puts_received_from_[j] >= kreq.wait_puts(j)) {
+          break;
+        }
+      }
+      Sleep(FLAGS_sleep_time);
+    }
+  }
+  stats_["pipeline_wait_time"] += t.elapsed();
+}
+
+// Send our buffered updates, then report the number of put requests sent
+// to each worker by everyone in our subtree.
+void Worker::HandleFlush(const FlushRequest& req) {
+  Flush(req.send_held());
+
+  vector<int> children = ChildRanks();
+  for (int i = 0; i < children.size(); ++i) {
+    network_->Send(children[i], MTYPE_WORKER_FLUSH, req);
+  }
+
+  FlushResponse resp;
+  for (int j = 0; j < num_peers_; ++j) {
+    resp.add_puts_sent(network_->sent_count(j + 1, MTYPE_PUT_REQUEST));
+  }
+
+  AggregatorRegistry::Map &aggs = AggregatorRegistry::Get()->aggregators();
+  FlushResponse child;
+  for (int i = 0; i < children.size(); ++i) {
+    ReadFromPeer(children[i], MTYPE_WORKER_FLUSH_DONE, &child);
+    for (int j = 0; j < num_peers_; ++j) {
+      resp.set_puts_sent(j, resp.puts_sent(j) + child.puts_sent(j));
+    }
+    for (int j = 0; j < child.partials_size(); ++j) {
+      aggs[child.partials(j).id()]->merge_partial(child.partials(j).value());
+    }
+  }
+
+  for (AggregatorRegistry::Map::iterator i = aggs.begin(); i != aggs.end(); ++i) {
+    string partial;
+    if (i->second->take_partial(&partial)) {
+      AggregatorData* a = resp.add_partials();
+      a->set_id(i->first);
+      a->set_value(partial);
+    }
+  }
+
+  network_->Send(ParentRank(), MTYPE_WORKER_FLUSH_DONE, resp);
+}
+
+// Wait until every put request sent to us before the flush has arrived and
+// been applied, then report for our subtree.
+void Worker::HandleApply(const ApplyRequest& req) {
+  vector<int> children = ChildRanks();
+  for (int i = 0; i < children.size(); ++i) {
+    network_->Send(children[i], MTYPE_WORKER_APPLY, req);
+  }
+
+  AggregatorRegistry::Map &aggs = AggregatorRegistry::Get()->aggregators();
+  for (int i = 0; i < req.totals_size(); ++i) {
+    aggs[req.totals(i).id()]->set_total(req.totals(i).value());
+  }
+
+  while (true) {
+    HandlePutRequests();
+    {
+      boost::recursive_mutex::scoped_lock sl(state_lock_);
+      if (puts_received_ >= req.puts_expected(id())) {
+        break;
+      }
+    }
+    Sleep(FLAGS_sleep_time);
+  }
+
+  EmptyMessage empty;
+  for (int i = 0; i < children.size(); ++i) {
+    ReadFromPeer(children[i], MTYPE_WORKER_APPLY_DONE, &empty);
+  }
+
+  network_->Send(ParentRank(), MTYPE_WORKER_APPLY_DONE, empty);
+}
+
+void Worker::UpdateReplicas() {
+  Timer timer;
+  int pending = 0;
+  TableRegistry::Map &tables = TableRegistry::Get()->tables();
+  for (TableRegistry::Map::iterator i = tables.begin(); i != tables.end(); ++i) {
+    GlobalTable *t = i->second;
+    if (!t->replicated()) {
+      continue;
+    }
+
+    t->SendReplicas();
+    for (int j = 0; j < t->num_shards(); ++j) {
+      if (!t->is_local_shard(j)) {
+        ++pending;
+      }
+    }
+  }
+
+  // Each remote shard arrives as a single message from its owner.
+  TableData put;
+  while (pending > 0) {
+    network_->Read(MPI::ANY_SOURCE, MTYPE_REPLICA_DATA, &put);
+    TableRegistry::Get()->table(put.table())->ApplyReplica(put);
+    --pending;
   }
 
-  while (network_->TryRead(config_.master_id(), MTYPE_WORKER_APPLY, &empty)) {
-		HandlePutRequests();
-    network_->Send(config_.master_id(), MTYPE_WORKER_APPLY_DONE, empty);
-	}
+  stats_["replica_time"] += timer.elapsed();
 }
 
 bool StartWorker(const ConfigData& conf) {
@@ -11,6 +11,7 @@
 #include "piccolo/worker.pb.h"
 
 #include <boost/thread.hpp>
+#include <deque>
 #include <mpi.h>
 
 using boost::shared_ptr;
@@ -43,11 +44,44 @@ public:
   void HandleShardAssignment();
   void HandleIteratorRequests();
   void HandlePutRequests();
+  void HandleTaskCommit();
 
-  // Barrier: wait until all table data is transmitted.
-  void Flush();
+  // Flush the write buffers of tables whose updates have waited longer than
+  // the table's max_flush_delay.
+  void CheckFlushDelays();
+
+  // True if updates from peers are applied by a dedicated thread.
+  bool threaded_apply() const { return apply_thread_ != NULL; }
+
+  // True if requests from peers are served by a pool of server threads.
+  bool threaded_reads() const { return !server_threads_.empty(); }
+
+  // Barrier: wait until all table data is transmitted.  Updates held back
+  // by tables' delta thresholds are sent only if 'send_held' is true.
+  void Flush(bool send_held=false);
+
+  // The flush and apply rounds of the master's barrier.  Barrier messages
+  // pass down a tree rooted at the master, and replies are combined on the
+  // way back up.
+  void HandleFlush(const FlushRequest& req);
+  void HandleApply(const ApplyRequest& req);
+
+  // Wait for the updates which the tasks a graph task depends on sent to
+  // this worker, and apply them.
+  void WaitForPuts(const KernelRequest& kreq);
+
+  // Run a kernel method over our shards in rounds, deciding when to stop
+  // together with the other workers.
+  void RunLoop(const KernelRequest& kreq);
+
+  // Exchange the contents of replicated tables with all peers.
+  void UpdateReplicas();
 
   int peer_for_shard(int table_id, int shard) const;
+
+  // The worker to send updates destined for 'peer' to: either the peer
+  // itself, or the aggregator for this host if the peer is on another host.
+  int update_target(int peer) const;
   int id() const { return config_.worker_id(); };
   int epoch() const { return epoch_; }
 
@@ -62,6 +96,53 @@ private:
   void Restore(int epoch);
   void UpdateEpoch(int peer, int peer_epoch);
 
+  // Move kernel requests from the network into queued_kernels_.
+  void QueueKernelRequests();
+
+  // Take the next queued kernel request to run, if there is one.
+  bool NextKernelRequest(KernelRequest* kreq);
+
+  // Hold aside the updates of a speculative kernel until the master tells
+  // us whether to keep them.  EndSpeculation returns true if they were kept.
+  void BeginSpeculation(const KernelRequest& kreq);
+  bool EndSpeculation(const KernelRequest& kreq);
+  void CancelSpeculation();
+
+  // Our parent and children in the barrier tree, as network ranks.
+  int ParentRank() const;
+  vector<int> ChildRanks() const;
+
+  // Wait for a message from a peer, applying updates meanwhile.
+  void ReadFromPeer(int rank, int type, Message* msg);
+
+  // Sum 'values' and 'counts' element-wise over all workers, leaving the
+  // totals on every worker.  Partial sums pass up a tree rooted at the
+  // first worker, without involving the master.
+  void AllReduce(vector<double>* values, vector<int64_t>* counts);
+
+  // End a round of a loop: flush our updates, and wait until every worker
+  // has applied those sent to it.  Returns the sum of 'delta' over all
+  // workers.
+  double SyncRound(double delta, bool send_held);
+
+  // The kernel instance for the given kernel, table and shard.
+  DSMKernel* GetKernel(const string& kernel, int table, int shard);
+
+  // Describe our table shards to the master.
+  void AddShardInfo(KernelDone* kd);
+
+  // Apply thread: drains put requests as they arrive.  Updates for the shard
+  // the kernel is currently running on are deferred until the kernel exits.
+  void ApplyLoop();
+  void SignalApplyThread();
+  void DrainPutRequests(bool defer_active);
+  void ApplyPut(const TableData& put);
+
+  // Server threads: answer get and iterator requests from other workers,
+  // leaving the network thread free to move data.
+  void ServerLoop();
+  void SignalServerThreads();
+
   mutable boost::recursive_mutex state_lock_;
 
   // The current epoch this worker is running within.
@@ -83,6 +164,9 @@ private:
   NetworkThread *network_;
   unordered_set<GlobalTable*> dirty_tables_;
 
+  // Host aggregator for each worker, if host aggregation is enabled.
+  vector<int> aggregators_;
+
   uint32_t iterator_id_;
   unordered_map<uint32_t, TableIterator*> iterators_;
 
@@ -108,6 +192,38 @@ private:
 
   map<KernelId, DSMKernel*> kernels_;
 
+  // Kernel requests received from the master but not yet started, in the
+  // order they were sent; guarded by state_lock_.
+  std::deque<KernelRequest> queued_kernels_;
+
+  // The (table, shard) of the speculative kernel running, if any, and the
+  // master's decisions on speculative kernels; guarded by state_lock_.
+  pair<int, int> speculative_task_;
+  typedef map<pair<int, int>, bool> VerdictMap;
+  VerdictMap verdicts_;
+
+  boost::thread *apply_thread_;
+  boost::mutex apply_lock_;
+  boost::condition_variable apply_cond_;
+  double apply_time_;
+
+  int active_table_;
+  int active_shard_;
+  vector<TableData*> deferred_puts_;
+
+  // Put requests applied (or, for epoch markers, taken from the network),
+  // in total and from each peer; guarded by state_lock_.
+  int64_t puts_received_;
+  vector<int64_t> puts_received_from_;
+
+  vector<boost::thread*> server_threads_;
+  boost::mutex server_lock_;
+  boost::condition_variable server_cond_;
+  boost::mutex iterator_lock_;
+
+  // Time taken to answer each get request; guarded by server_lock_.
+  Histogram get_service_time_;
+
   Stats stats_;
 };
 
@@ -7,6 +7,15 @@ Yes, alliteration is fun.
 
 Transforms .pp files to C++, replacing instances of the PMap and PReduce
 calls with calls to generated kernels and barriers.
+
+PLoop({k : table, ...}, max_rounds, converged, { code }) runs the code of a
+PMap in rounds on the workers, until the sum of the values passed to
+add_delta() in a round falls below converged.
+
+PMapChanged({k : table, ...}, { code }) is a PMap over only the entries of
+table changed since the last PMapChanged over it; the table must track
+changes.  Its values are copies, so changes to them must be stored with
+put or update.
 '''  
 
 import os, sys, re, _sre
@@ -109,7 +118,7 @@ public:
   
   template <class TableA>
   void run_loop(TableA* a) {
-    typename TableA::Iterator *it =  a->get_typed_iterator(current_shard());
+    typename TableA::Iterator *it =  a->%(iterator)s(current_shard());
     for (; !it->done(); it->Next()) {
       run_iter(it->key(), %(calls)s);
     }
@@ -173,9 +182,12 @@ def ParseCode(s):
       s.pop()
       return code
   
-def ParsePMap(s):
+def ParsePMap(s, loop=False, changed=False):
   s.push('ParsePMap')
-  _, keys, _, code, _ = s.read(r'\(', '{'), ParseKeys(s), s.read('}', ','), ParseCode(s), s.read(r'\)', ';')
+  _, keys, _ = s.read(r'\(', '{'), ParseKeys(s), s.read('}', ',')
+  if loop:
+    max_rounds, _, converged, _ = s.read(r'[^,]+', ',', r'[^,]+', ',')
+  code, _ = ParseCode(s), s.read(r'\)', ';')
   
   
   filename = os.path.basename(s._f)
@@ -184,7 +196,11 @@ def ParsePMap(s):
   id = get_id()
   main_table = keys[0][1]
   
-  s._out += 'm.run_all("%sMapKernel%d", "map", %s);' % (prefix, id, main_table)
+  if loop:
+    s._out += 'm.run_loop(RunDescriptor("%sMapKernel%d", "map", %s), %s, %s);' % (
+        prefix, id, main_table, max_rounds, converged)
+  else:
+    s._out += 'm.run_all("%sMapKernel%d", "map", %s);' % (prefix, id, main_table)
   
   i = 0
   klasses, decls, calls = [], [], []
@@ -206,7 +222,8 @@ def ParsePMap(s):
                             calls = ','.join(calls),
                             klasses = ','.join(klasses),
                             code = code, 
-                            main_table = main_table) + '\n'
+                            main_table = main_table,
+                            iterator = 'get_changed_iterator' if changed else 'get_typed_iterator') + '\n'
   s.pop()
  
 
@@ -254,9 +271,11 @@ def ProcessFile(f_in, f_out):
   print >>f_out, '#line 1 "%s"' % os.path.basename(f_in)
   
   while 1:
-    g = s.search('PMap|PRunOne|PRunAll')
+    g = s.search('PMapChanged|PMap|PLoop|PRunOne|PRunAll')
     if not g: break
-    if g.group(0) == 'PMap': ParsePMap(s)
+    if g.group(0) == 'PMapChanged': ParsePMap(s, changed=True)
+    elif g.group(0) == 'PMap': ParsePMap(s)
+    elif g.group(0) == 'PLoop': ParsePMap(s, loop=True)
     elif g.group(0) == 'PRunOne': ParsePRunOne(s)
     elif g.group(0) == 'PRunAll': ParsePRunAll(s)
   